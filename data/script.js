@@ -1,5 +1,7 @@
 var gateway = `ws://${window.location.hostname}/ws`;
 var websocket;
+var netChange = null; // Old and new device address while network settings are applied
+var netTry = 0;
 
 // Wait for the DOM to be ready
 $(document).ready(function () {
@@ -124,11 +126,24 @@ function initWebSocket() {
 // Called when the connection is open.
 function onSocketOpen() {
 	console.log("Connection opened");
+	// Device answers on new address: settings applied, follow it. On old address settings were rolled back
+	if (netChange != null) {
+		var host = new URL(websocket.url).hostname;
+		if (host == netChange.next && host != netChange.old) {
+			window.location.href = `http://${host}/`;
+		}
+		if (host == netChange.old) netChange = null;
+	}
 }
 
 // Called when the connection is closed.
 function onSocketClose() {
 	console.log("Connection closed");
+	// Device is switching network: try new and old address in turn
+	if (netChange != null) {
+		var host = netTry++ % 2 == 0 ? netChange.next : netChange.old;
+		gateway = `ws://${host}/ws`;
+	}
 	setTimeout(initWebSocket, 2000);
 }
 
@@ -165,10 +180,40 @@ function onReceiveMessage(event) {
 			$("#labelCalibrate1").text("-выполняется настройка длины");
 			$("#labelCalibrate2").text("-выполняется настройка длины");
 		}
+
+		// Homing run to upper switch after settings import
+		if (calibrateStatus == "home") {
+			$("#btnCalibrate").addClass("blinking-btn");
+			$("#labelCalibrate1").text("-поиск верхнего положения");
+			$("#labelCalibrate2").text("-поиск верхнего положения");
+		}
 	} else {
 		//$("#footer1").addClass("red-footer");
 		//$("#footer2").addClass("red-footer");
 	}
+	// Network settings changed, follow device to its new address only when it is known to work.
+	// With DHCP the new address is unknown, mDNS host is used instead
+	if (data.network != null) {
+		console.log("Network: " + data.network.status + " " + data.network.ip);
+		if (data.network.status == "applying") {
+			netChange = {
+				old: window.location.hostname,
+				next: data.network.ip || data.network.host,
+			};
+			netTry = 0;
+		}
+		if (data.network.status == "applied") {
+			netChange = null;
+			if (data.network.ip && data.network.ip != window.location.hostname) {
+				window.location.href = `http://${data.network.ip}/`;
+			}
+		}
+		if (data.network.status == "rolledBack") {
+			netChange = null;
+			gateway = `ws://${window.location.hostname}/ws`;
+		}
+	}
+
 	// Read shade lenght
 	if (data.shadeLenght != null) var shadeLenght = data.shadeLenght;
 
@@ -0,0 +1,141 @@
+// File system latency benchmark: SPIFFS vs LittleFS on the data partition
+// Build and run: pio run -e fsbench -t upload -t monitor
+// Warning: the data partition is formatted, settings and web pages are lost
+#include <Arduino.h>
+#include "SPIFFS.h"
+#include <LittleFS.h>
+
+#define REPEAT 10
+
+const size_t sizes[] = {256, 1024, 4096};
+const int fillLevels[] = {0, 50, 75, 90};
+uint8_t buf[4096];
+
+struct Backend
+{
+	const char *name;
+	fs::FS &fs;
+	bool (*begin)(bool format);
+	void (*end)();
+	bool (*format)();
+	size_t (*total)();
+	size_t (*used)();
+};
+
+Backend backends[] = {
+	{"SPIFFS", SPIFFS, [](bool format)
+	 { return SPIFFS.begin(format); },
+	 []()
+	 { SPIFFS.end(); },
+	 []()
+	 { return SPIFFS.format(); },
+	 []()
+	 { return SPIFFS.totalBytes(); },
+	 []()
+	 { return SPIFFS.usedBytes(); }},
+	{"LittleFS", LittleFS, [](bool format)
+	 { return LittleFS.begin(format); },
+	 []()
+	 { LittleFS.end(); },
+	 []()
+	 { return LittleFS.format(); },
+	 []()
+	 { return LittleFS.totalBytes(); },
+	 []()
+	 { return LittleFS.usedBytes(); }},
+};
+
+// Write file and wait until data is on flash, returns time in microseconds
+unsigned long writeSync(fs::FS &fs, const char *path, size_t size)
+{
+	unsigned long start = micros();
+	File file = fs.open(path, FILE_WRITE);
+	file.write(buf, size);
+	file.flush();
+	file.close();
+	return micros() - start;
+}
+
+// Fill file system with filler files up to percent of total size
+void fill(Backend &b, int percent)
+{
+	static int n = 0;
+	char path[32];
+	while (b.used() * 100 < b.total() * percent)
+	{
+		sprintf(path, "/fill%d.bin", n++);
+		File file = b.fs.open(path, FILE_WRITE);
+		for (int i = 0; i < 8; i++)
+			file.write(buf, sizeof(buf));
+		file.close();
+	}
+}
+
+void runBackend(Backend &b)
+{
+	unsigned long start, total;
+	char path[32];
+
+	Serial.printf("\n=== %s ===\n", b.name);
+	b.begin(true);
+	start = micros();
+	b.format();
+	Serial.printf("format: %lu ms\n", (micros() - start) / 1000);
+	b.end();
+
+	start = micros();
+	if (!b.begin(false))
+	{
+		Serial.println("mount failed");
+		return;
+	}
+	Serial.printf("mount empty: %lu us, total %u bytes\n", micros() - start, b.total());
+
+	for (int level : fillLevels)
+	{
+		fill(b, level);
+		Serial.printf("-- fill %d%% (used %u bytes)\n", level, b.used());
+		for (size_t size : sizes)
+		{
+			unsigned long write = 0, open = 0, read = 0;
+			for (int i = 0; i < REPEAT; i++)
+			{
+				sprintf(path, "/bench%u_%d.json", size, i);
+				write += writeSync(b.fs, path, size);
+
+				start = micros();
+				File file = b.fs.open(path);
+				open += micros() - start;
+				start = micros();
+				file.read(buf, size);
+				read += micros() - start;
+				file.close();
+			}
+			Serial.printf("%5u bytes: open %6lu us, read %6lu us, write-sync %6lu us\n", size, open / REPEAT, read / REPEAT, write / REPEAT);
+		}
+	}
+
+	// Mount time with files present
+	b.end();
+	start = micros();
+	b.begin(false);
+	total = micros() - start;
+	Serial.printf("mount filled: %lu us\n", total);
+	b.end();
+}
+
+void setup()
+{
+	Serial.begin(115200);
+	delay(1000);
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+	for (Backend &b : backends)
+		runBackend(b);
+	Serial.println("\nBenchmark finished, upload firmware and file system image again");
+}
+
+void loop()
+{
+	delay(1000);
+}
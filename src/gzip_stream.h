@@ -0,0 +1,209 @@
+// Gzip decoder for compressed OTA, host tests get rom/ headers from test/host
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <functional>
+#include "rom/miniz.h"
+#include "rom/crc.h"
+
+// Streaming gzip decoder for OTA images, inflated data goes to writer in dictionary-sized chunks
+class GzipStream
+{
+public:
+	typedef std::function<bool(const uint8_t *, size_t)> Writer;
+
+	bool begin(Writer writer)
+	{
+		end();
+		_writer = writer;
+		_inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+		_dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+		if (!_inflator || !_dict)
+		{
+			end();
+			return fail("out of memory");
+		}
+		tinfl_init(_inflator);
+		_state = GZ_HEADER;
+		_pos = 0;
+		_skip = 0;
+		_dictOfs = 0;
+		_crc = 0;
+		_outSize = 0;
+		_error = nullptr;
+		return true;
+	}
+
+	// Feed next chunk of compressed data
+	bool write(const uint8_t *data, size_t len)
+	{
+		size_t i = 0;
+		while (i < len && !_error)
+		{
+			if (_state == GZ_DATA)
+				i += inflate(data + i, len - i);
+			else if (_state == GZ_DONE)
+				return fail("data after end of stream");
+			else
+				parseByte(data[i++]);
+		}
+		return !_error;
+	}
+
+	void end()
+	{
+		free(_inflator);
+		free(_dict);
+		_inflator = nullptr;
+		_dict = nullptr;
+	}
+
+	bool finished() { return _state == GZ_DONE && !_error; }
+	const char *error() { return _error ? _error : (finished() ? nullptr : "truncated stream"); }
+	size_t outputSize() { return _outSize; }
+
+private:
+	enum
+	{
+		GZ_HEADER,
+		GZ_EXTRA_LEN,
+		GZ_EXTRA,
+		GZ_NAME,
+		GZ_COMMENT,
+		GZ_HCRC,
+		GZ_DATA,
+		GZ_TRAILER,
+		GZ_DONE
+	};
+	static const uint8_t FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08, FCOMMENT = 0x10;
+
+	Writer _writer;
+	tinfl_decompressor *_inflator = nullptr;
+	uint8_t *_dict = nullptr;
+	size_t _dictOfs = 0;
+	int _state = GZ_HEADER;
+	uint8_t _flags = 0;
+	uint8_t _buf[10];
+	size_t _pos = 0;
+	size_t _skip = 0;
+	uint32_t _crc = 0;
+	size_t _outSize = 0;
+	const char *_error = nullptr;
+
+	bool fail(const char *error)
+	{
+		_error = error;
+		return false;
+	}
+
+	// Move to the next optional header field present in flags
+	void nextHeaderField()
+	{
+		_pos = 0;
+		if (_state < GZ_EXTRA_LEN && (_flags & FEXTRA))
+			_state = GZ_EXTRA_LEN;
+		else if (_state < GZ_NAME && (_flags & FNAME))
+			_state = GZ_NAME;
+		else if (_state < GZ_COMMENT && (_flags & FCOMMENT))
+			_state = GZ_COMMENT;
+		else if (_state < GZ_HCRC && (_flags & FHCRC))
+			_state = GZ_HCRC;
+		else
+			_state = GZ_DATA;
+	}
+
+	// Header and trailer are parsed byte by byte, they may be split between chunks
+	void parseByte(uint8_t b)
+	{
+		switch (_state)
+		{
+		case GZ_HEADER:
+			_buf[_pos++] = b;
+			if (_pos == 10)
+			{
+				if (_buf[0] != 0x1f || _buf[1] != 0x8b || _buf[2] != 8)
+				{
+					fail("not a gzip image");
+					return;
+				}
+				_flags = _buf[3];
+				nextHeaderField();
+			}
+			break;
+		case GZ_EXTRA_LEN:
+			_buf[_pos++] = b;
+			if (_pos == 2)
+			{
+				_skip = _buf[0] | (_buf[1] << 8);
+				_state = GZ_EXTRA;
+				if (_skip == 0)
+					nextHeaderField();
+			}
+			break;
+		case GZ_EXTRA:
+			if (--_skip == 0)
+				nextHeaderField();
+			break;
+		case GZ_NAME:
+		case GZ_COMMENT:
+			if (b == 0)
+				nextHeaderField();
+			break;
+		case GZ_HCRC:
+			if (++_pos == 2)
+				nextHeaderField();
+			break;
+		case GZ_TRAILER:
+			_buf[_pos++] = b;
+			if (_pos == 8)
+			{
+				uint32_t crc = _buf[0] | (_buf[1] << 8) | (_buf[2] << 16) | ((uint32_t)_buf[3] << 24);
+				uint32_t isize = _buf[4] | (_buf[5] << 8) | (_buf[6] << 16) | ((uint32_t)_buf[7] << 24);
+				if (crc != _crc)
+					fail("CRC mismatch");
+				else if (isize != (uint32_t)_outSize)
+					fail("size mismatch");
+				else
+					_state = GZ_DONE;
+			}
+			break;
+		}
+	}
+
+	// Inflate compressed data, returns number of consumed bytes
+	size_t inflate(const uint8_t *data, size_t len)
+	{
+		size_t consumed = 0;
+		tinfl_status status;
+		do
+		{
+			size_t inBytes = len - consumed;
+			size_t outBytes = TINFL_LZ_DICT_SIZE - _dictOfs;
+			status = tinfl_decompress(_inflator, data + consumed, &inBytes, _dict, _dict + _dictOfs, &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+			consumed += inBytes;
+			if (outBytes)
+			{
+				if (!_writer(_dict + _dictOfs, outBytes))
+				{
+					fail("write error");
+					return consumed;
+				}
+				_crc = crc32_le(_crc, _dict + _dictOfs, outBytes);
+				_outSize += outBytes;
+				_dictOfs = (_dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+			}
+			if (status < TINFL_STATUS_DONE)
+			{
+				fail("corrupted deflate stream");
+				return consumed;
+			}
+		} while (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && consumed < len));
+
+		if (status == TINFL_STATUS_DONE)
+		{
+			_state = GZ_TRAILER;
+			_pos = 0;
+		}
+		return consumed;
+	}
+};
@@ -0,0 +1,156 @@
+// Board and motor profiles, selected at compile time by build flag:
+//   -DBOARD_ESP32DEV  original driver board (default)
+//   -DBOARD_TMC2209   TMC2209 carrier board with 1/8 microstepping
+//   host build (no ARDUINO) uses HostBoard on shadow registers, pins can be inspected by host code
+#pragma once
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <soc/gpio_struct.h>
+#endif
+
+// Pin map and polarity of original driver board
+struct Esp32DevBoard
+{
+	static constexpr uint8_t dirPin = 27;
+	static constexpr uint8_t stepPin = 25;
+	static constexpr uint8_t nEnPin = 26;
+	static constexpr uint8_t switchPin = 16;
+	static constexpr uint8_t ledPin = 22;
+	static constexpr uint8_t resetPin = 13;
+	static constexpr uint8_t lightChannel = 6; // ADC1 channel, GPIO 34
+	static constexpr bool switchActiveLow = true;
+	static constexpr bool dirDownLevel = true;
+};
+
+// TMC2209 carrier: enable and direction on the other header side, switch to 3.3 V
+struct Tmc2209Board
+{
+	static constexpr uint8_t dirPin = 18;
+	static constexpr uint8_t stepPin = 19;
+	static constexpr uint8_t nEnPin = 21;
+	static constexpr uint8_t switchPin = 17;
+	static constexpr uint8_t ledPin = 2;
+	static constexpr uint8_t resetPin = 13;
+	static constexpr uint8_t lightChannel = 6;
+	static constexpr bool switchActiveLow = false;
+	static constexpr bool dirDownLevel = false;
+};
+
+// Host tests: original pin map, driven through shadow registers
+struct HostBoard : Esp32DevBoard
+{
+};
+
+// Stepper, driver and roller. Speeds in steps/s, accel in steps/s^2, 0 disables ramp
+template <uint16_t FullSteps, uint8_t Microsteps, uint16_t RollerMm, uint16_t MaxSpeed, uint16_t Accel>
+struct MotorProfile
+{
+	static constexpr uint16_t fullSteps = FullSteps;
+	static constexpr uint8_t microsteps = Microsteps;
+	static constexpr uint16_t rollerMm = RollerMm; // Roller circumference
+	static constexpr float stepsPerMm = (float)FullSteps * Microsteps / RollerMm;
+	static constexpr uint16_t maxSpeed = MaxSpeed;
+	static constexpr uint16_t minSpeed = MaxSpeed / 10;
+	static constexpr uint16_t accel = Accel;
+	static constexpr unsigned int halfPeriod = 500000 / MaxSpeed; // us
+};
+
+typedef MotorProfile<200, 1, 60, 500, 0> DirectMotor;
+typedef MotorProfile<200, 8, 60, 4000, 8000> Microstep8Motor;
+
+// Shade position scale
+constexpr int SHADE_MAX = 100;
+
+#ifdef ARDUINO
+// GPIO with pin number known at compile time: single register store, no pin table lookup
+template <uint8_t Pin>
+struct FastPin
+{
+	static inline __attribute__((always_inline)) void set(bool level)
+	{
+		if (Pin < 32)
+		{
+			if (level)
+				GPIO.out_w1ts = 1UL << (Pin & 31);
+			else
+				GPIO.out_w1tc = 1UL << (Pin & 31);
+		}
+		else
+		{
+			if (level)
+				GPIO.out1_w1ts.val = 1UL << (Pin & 31);
+			else
+				GPIO.out1_w1tc.val = 1UL << (Pin & 31);
+		}
+	}
+	static inline __attribute__((always_inline)) bool get()
+	{
+		return Pin < 32 ? (GPIO.in >> (Pin & 31)) & 1 : (GPIO.in1.val >> (Pin & 31)) & 1;
+	}
+};
+#else
+// Host shadow of GPIO output and input registers
+template <int N = 0>
+struct HostGpio
+{
+	static uint64_t out;
+	static uint64_t in;
+};
+template <int N>
+uint64_t HostGpio<N>::out = 0;
+template <int N>
+uint64_t HostGpio<N>::in = 0;
+
+template <uint8_t Pin>
+struct FastPin
+{
+	static inline void set(bool level)
+	{
+		if (level)
+			HostGpio<>::out |= 1ULL << Pin;
+		else
+			HostGpio<>::out &= ~(1ULL << Pin);
+	}
+	static inline bool get()
+	{
+		return (HostGpio<>::in >> Pin) & 1;
+	}
+};
+#endif
+
+// Board pins combined with motor parameters
+template <class Board, class Motor>
+struct Hardware : Board, Motor
+{
+	typedef FastPin<Board::dirPin> Dir;
+	typedef FastPin<Board::stepPin> Step;
+	typedef FastPin<Board::nEnPin> NEn;
+	typedef FastPin<Board::switchPin> Switch;
+	typedef FastPin<Board::ledPin> Led;
+
+	static inline void enable(bool on) { NEn::set(!on); }
+	static inline void direction(bool down) { Dir::set(down == Board::dirDownLevel); }
+	static inline void step(bool level) { Step::set(level); }
+	static inline void led(bool on) { Led::set(on); }
+	static inline bool switchPressed() { return Switch::get() != Board::switchActiveLow; }
+};
+
+#if !defined(ARDUINO)
+typedef Hardware<HostBoard, Microstep8Motor> Hw; // Ramped motor so host code runs acceleration
+#elif defined(BOARD_TMC2209)
+typedef Hardware<Tmc2209Board, Microstep8Motor> Hw;
+#else
+typedef Hardware<Esp32DevBoard, DirectMotor> Hw;
+#endif
+
+// Shade percent to motor position and back
+inline int shadeToPos(int shade, int length)
+{
+	return (int)((double)length * shade / SHADE_MAX);
+}
+
+inline int posToShade(int pos, int length)
+{
+	return length > 0 ? (int)((double)SHADE_MAX * pos / length) : 0;
+}
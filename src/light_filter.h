@@ -0,0 +1,66 @@
+// Ambient light filter, no Arduino dependencies so it can be tested on host
+#pragma once
+#include <stdint.h>
+
+#define LIGHT_FILTER_SHIFT 6 // IIR time constant 64 blocks
+#define LIGHT_UNKNOWN 0
+#define LIGHT_DARK 1
+#define LIGHT_BRIGHT 2
+
+// Ambient light automation settings, thresholds in raw 12-bit ADC units
+struct LightSettings
+{
+	bool enabled;
+	uint16_t high;		   // Level to switch to bright state
+	uint16_t low;		   // Level to switch to dark state
+	uint8_t shadeBright;   // Shade in bright state, percent
+	uint8_t shadeDark;	   // Shade in dark state, percent
+	uint32_t holdMs;	   // Level must stay past threshold this long
+	uint32_t minIntervalMs; // Minimum time between light moves
+};
+
+// Fixed-point IIR low-pass with hysteresis, fed with DMA block averages
+struct LightFilter
+{
+	int32_t level = -1; // Filtered level << 8, -1 before first block
+	int state = LIGHT_UNKNOWN;
+	int candidate = LIGHT_UNKNOWN;
+	uint32_t candidateSince = 0;
+	uint32_t lastMove = 0;
+	bool moved = false;
+
+	// Returns new shade target when state changes, -1 otherwise
+	int update(uint16_t sample, uint32_t ms, const LightSettings &cfg)
+	{
+		if (level < 0)
+			level = (int32_t)sample << 8;
+		else
+			level += (((int32_t)sample << 8) - level) >> LIGHT_FILTER_SHIFT;
+
+		// Between thresholds the state is kept
+		int value = level >> 8;
+		int wanted = state;
+		if (value >= cfg.high)
+			wanted = LIGHT_BRIGHT;
+		else if (value <= cfg.low)
+			wanted = LIGHT_DARK;
+
+		if (wanted == state)
+		{
+			candidate = state;
+			return -1;
+		}
+		if (wanted != candidate)
+		{
+			candidate = wanted;
+			candidateSince = ms;
+		}
+		if (ms - candidateSince < cfg.holdMs || (moved && ms - lastMove < cfg.minIntervalMs))
+			return -1;
+
+		state = wanted;
+		lastMove = ms;
+		moved = true;
+		return state == LIGHT_BRIGHT ? cfg.shadeBright : cfg.shadeDark;
+	}
+};
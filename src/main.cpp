@@ -2,25 +2,136 @@
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #include "SPIFFS.h"
+#include <LittleFS.h>
+#include <Preferences.h>
 #include <ElegantOTA.h>
 #include <time.h>
 #include <WiFi.h>
+#include <ESPmDNS.h>
 #include <HTTPClient.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include "rom/crc.h"
+#include "rom/miniz.h"
+#include <Update.h>
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <atomic>
+#include <vector>
+#include "hardware.h"
+#include "gzip_stream.h"
+#include "light_filter.h"
+#include "motion_queue.h"
+#include "ota_verify.h"
+#include "ws_json.h"
 
-#define SM_DIR 27
-#define SM_STEP 25
-#define SM_nEN 26
-#define SW 16
-#define LED_CONNECT 22
-#define INIT_RESET_BTN 13
 #define MOVE_STOP 0
 #define MOVE_UP 1
 #define MOVE_DOWN 2
 #define MOVE_CALIBRATE 3
+#define CHECKPOINT_MAGIC 0x53484144
+#define CHECKPOINT_FLASH_PERIOD 10000
+#define MAX_TIMERS 32
+#define WS_MAX_MESSAGE 8192
+#define STORE_SHADE 0x01
+#define STORE_TIMERS 0x02
+#define STORE_CONNECTION 0x04
+#define SEND_SHADE 0x08
+#define SEND_TIMERS 0x10
+#define DO_RESTART 0x20
+#define SEND_STATS 0x40
+#define IDLE_WAKE_PERIOD 1000
+#define STATS_PERIOD 60000
+#define HISTORY_PAGES 32
+#define HISTORY_PAGE_SIZE 256
+#define HISTORY_MAGIC 0x4853
+#define HISTORY_PENDING 16 // Moves of a full motion queue are flushed after it drains
+#define HISTORY_QUERY_PAGE 20
+#define SRC_CLIENT 0
+#define SRC_TIMER 1
+#define SRC_SUNRISE 2
+#define SRC_SUNSET 3
+#define SRC_CALIBRATE 4
+#define SRC_LIGHT 5
+#define SRC_QUEUE 6
+#define HIST_FLAG_STOPPED 0x01
+#define LIGHT_ADC_CHANNEL ((adc1_channel_t)Hw::lightChannel) // ADC1 is free while WiFi uses ADC2
+#define LIGHT_SAMPLE_RATE 10000
+#define LIGHT_DMA_LEN 1000				 // Samples per DMA block, 10 blocks per second
+#define SEND_QUEUE 0x80
+#define NET_IDLE 0
+#define NET_APPLY 1
+#define NET_TRYING 2
+#define NET_ROLLBACK 3
+#define NET_APPLY_TIMEOUT 15000
+#define NET_POLL_PERIOD 100
+#define MDNS_NAME "easyshade" // Station mode address that does not change with DHCP: easyshade.local
+#define TRACE_SIZE 256 // Trace ring size, power of 2
+#define TR_WS_RX 0
+#define TR_PARSE 1
+#define TR_APPLY 2
+#define TR_PERSIST 3
+#define TR_BROADCAST 4
+#define TR_LOOP_PICKUP 5
+#define TR_MOTOR_START 6
+#define STATE_MAGIC 0x54535345 // "ESST"
+#define STATE_VERSION 1
+#define STATE_MAX_SIZE 8192
+#define SEC_CONNECTION 1
+#define SEC_CALIBRATION 2
+#define SEC_TIMERS 3
+#define SEC_LOCATION 4
+#define SEC_TUNING 5
 
 const char *shadePath = "/shade.json";
 const char *timersPath = "/timers.json";
 const char *csPath = "/connection.json";
+const char *historyPath = "/history.bin"; // Single file ring of older firmware, split into page files
+const char *positionPath = "/position.bin";
+
+// Settings files kept in NVS while the partition is converted from SPIFFS to LittleFS
+const char *migratePaths[] = {shadePath, timersPath, csPath};
+const char *migrateKeys[] = {"shade", "timers", "connection"};
+
+// File storage used for settings, history and web pages
+fs::FS &storage = LittleFS;
+
+// Built-in setup page, served while web pages are missing after migration format
+const char setupPage[] PROGMEM = R"rawliteral(<!DOCTYPE html>
+<html><head><meta charset="utf-8"><meta name="viewport" content="width=device-width, initial-scale=1">
+<title>easyShade setup</title></head>
+<body>
+<h3>Network</h3>
+<select id="ssid"><option value="">-</option></select><br>
+<input id="pass" placeholder="password"><br>
+<input id="ip" placeholder="ip"><br>
+<input id="gateway" placeholder="gateway"><br>
+<input id="dns" placeholder="dns"><br>
+<input id="subnet" placeholder="subnet"><br>
+<button onclick="send()">Save</button>
+<h3>Web pages are missing</h3>
+<p>Upload firmware or file system image: <a href="/update">/update</a></p>
+<script>
+var ws = new WebSocket("ws://" + location.hostname + "/ws");
+ws.onmessage = function (e) {
+	var data = JSON.parse(e.data);
+	if (!Array.isArray(data)) return;
+	data.forEach(function (n) {
+		var opt = document.createElement("option");
+		opt.value = opt.text = n;
+		document.getElementById("ssid").add(opt);
+	});
+};
+function send() {
+	var msg = { cmd: "auth" };
+	["ssid", "pass", "ip", "gateway", "dns", "subnet"].forEach(function (id) {
+		msg[id] = document.getElementById(id).value;
+	});
+	ws.send(JSON.stringify(msg));
+}
+</script>
+</body></html>
+)rawliteral";
 
 IPAddress localIP;
 IPAddress localGateway;
@@ -52,6 +163,69 @@ struct SunrieseSunsetTime
 
 SunrieseSunsetTime sstime;
 
+// Live position checkpoint in RTC slow memory, survives soft and watchdog resets
+struct PositionCheckpoint
+{
+	uint32_t magic;
+	uint32_t seq;
+	int32_t currentPos;
+	int32_t shadeLenght;
+	int32_t shade;
+	uint32_t checksum;
+};
+
+RTC_NOINIT_ATTR PositionCheckpoint rtcCheckpoint;
+uint32_t checkpointSeq = 0;
+unsigned long checkpointMillis = 0;
+
+// Movement history: ring of page files, each page has a base time and records with time delta
+struct HistoryPageHeader
+{
+	uint32_t base; // Page base time, epoch seconds
+	uint16_t seq;  // Page sequence number, newest page has highest
+	uint16_t magic;
+};
+
+struct HistoryRecord
+{
+	uint16_t dt;	   // Seconds from page base time
+	uint8_t source;	   // SRC_*, 0xFF for empty record
+	uint8_t from;	   // Shade before move, percent
+	uint8_t to;		   // Shade after move, percent
+	uint8_t flags;	   // HIST_FLAG_*
+	uint16_t duration; // Move duration, 0.1 sec
+};
+
+#define HISTORY_RECORDS ((HISTORY_PAGE_SIZE - sizeof(HistoryPageHeader)) / sizeof(HistoryRecord))
+
+// Finished move waiting to be written to flash while motor is stopped
+struct HistoryEvent
+{
+	uint32_t time;
+	HistoryRecord record;
+};
+
+int historyPage = HISTORY_PAGES - 1;
+int historyCount = HISTORY_RECORDS;
+uint32_t historyBase = 0;
+uint16_t historySeq = 0xFFFF;
+HistoryEvent historyPending[HISTORY_PENDING];
+int historyHead = 0;
+int historyTail = 0;
+
+LightSettings lightCfg = {false, 3000, 1500, 100, 0, 60000, 600000};
+portMUX_TYPE lightMux = portMUX_INITIALIZER_UNLOCKED;
+LightFilter lightFilter;
+volatile int lightShade = -1; // Target from light task, taken by main loop
+
+MotionQueue<Hw> motion;
+
+int moveSource = SRC_CLIENT;  // Source of current shade target
+bool moveStopped = false;	  // Move interrupted by stop command
+uint32_t moveStartTime = 0;	  // Move start, epoch seconds
+unsigned long moveStartMillis = 0;
+int moveFrom = 0;			  // Shade at move start, percent
+
 struct ConnectionSettings
 {
 	const char *ssid;
@@ -64,24 +238,42 @@ struct ConnectionSettings
 
 ConnectionSettings cs;
 
+// Network settings applied at runtime, old settings are kept for rollback
+struct NetworkSettings
+{
+	String ssid;
+	String pass;
+	String ip;
+	String gateway;
+	String dns;
+	String subnet;
+};
+
+NetworkSettings netNew;
+NetworkSettings netOld;
+volatile int netState = NET_IDLE;
+unsigned long netDeadline = 0;
+volatile bool netDropped = false; // Old association is gone since settings were applied
+
 DynamicJsonDocument shadeDoc(1024);
 DynamicJsonDocument csDoc(1024);
-DynamicJsonDocument timersDoc(1024);
+DynamicJsonDocument timersDoc(4096);
 DynamicJsonDocument networksDoc(1024);
 JsonArray timersArray = timersDoc.createNestedArray("timers");
+// Timers document is changed by commands and state import in network task and read by main loop schedule
+SemaphoreHandle_t timersMutex = NULL;
 
 unsigned long currMillis;
 unsigned long prevMillis;
 
-char ws_data[2048];
-size_t ws_len;
-
 int targetPos = 0;	// Tagret motor position in steps
 int shade = 0;		// Tagret motor position in percent
 int currentPos = 0; // Current motor position
 int shadeLenght = 0;
 int nTimers = 0;
 int tz = 3;
+float latitude = 54.93583;
+float longitude = 43.32352;
 
 int calibrateCnt = 0;
 String calibrateStatus = "false";
@@ -91,6 +283,30 @@ bool targetFlag = false;
 bool timeSyncFlag = false;
 int moveState = MOVE_STOP;
 bool clientRequest = false;
+
+// Main loop task sleeps on task notification while motor is stopped
+TaskHandle_t loopTask = NULL;
+unsigned long idleMicros = 0;	 // Time spent blocked since last stats
+unsigned long statsMillis = 0;	 // Last stats output
+unsigned long commandMicros = 0; // Time of last motion command, 0 if motion started
+
+// Command trace event in RAM ring, timestamp from esp_timer, one clock for both cores
+struct TraceEvent
+{
+	int64_t us;
+	uint16_t cmd;	 // Command id
+	uint8_t stage;	 // TR_*
+	uint8_t phase;	 // Chrome trace phase: 'B', 'E' or 'i'
+	uint8_t thread;	 // 1 - network task, 2 - main loop
+};
+
+const char *traceStages[] = {"ws_rx", "parse", "apply", "persist", "broadcast", "loop_pickup", "motor_start"};
+TraceEvent traceRing[TRACE_SIZE];
+std::atomic<uint32_t> traceHead(0);
+uint16_t traceCmd = 0;			   // Id of command handled by network task
+volatile uint16_t motionCmd = 0;   // Id of last command which changed shade target
+uint16_t pickedCmd = 0;			   // Id of last command picked up by main loop
+uint16_t moveCmd = 0;			   // Id of command which set current move, 0 for timer, sun and light moves
 bool onSunset = false;
 bool onSunrise = false;
 
@@ -100,313 +316,1935 @@ AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");
 
 unsigned long ota_progress_millis = 0;
+unsigned long ota_start_millis = 0;
+unsigned long reboot_millis = 0;
+
+void onOTAStart()
+{
+	// Log when OTA has started
+	Serial.println("OTA update started!");
+	ota_start_millis = millis();
+}
+
+void onOTAProgress(size_t current, size_t final)
+{
+	// Log every 1 second
+	if (millis() - ota_progress_millis > 1000)
+	{
+		ota_progress_millis = millis();
+		unsigned long elapsed = ota_progress_millis - ota_start_millis;
+		Serial.printf("OTA Progress Current: %u bytes, Final: %u bytes, %lu bytes/s\n", current, final, elapsed ? current * 1000UL / elapsed : 0);
+	}
+}
+
+void onOTAEnd(bool success)
+{
+	// Log when OTA has finished
+	if (success)
+	{
+		Serial.println("OTA update finished successfully!");
+	}
+	else
+	{
+		Serial.println("There was an error during OTA update!");
+	}
+	// <Add your own code here>
+}
+
+GzipStream gzOta;
+Sha256Writer otaSha;
+String otaError;
+
+// Compressed OTA upload: curl -F "file=@firmware.bin.gz" "http://<ip>/ota/upload-gz?sha256=<hash of firmware.bin>"
+void onGzOtaUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final)
+{
+	if (index == 0)
+	{
+		onOTAStart();
+		otaError = "";
+		String expected = request->hasParam("sha256") ? request->getParam("sha256")->value() : "";
+		if (!otaSha.begin([](const uint8_t *buf, size_t size)
+						  { return Update.write((uint8_t *)buf, size) == size; },
+						  expected.c_str()))
+			otaError = otaSha.error();
+		else if (!Update.begin(UPDATE_SIZE_UNKNOWN, U_FLASH))
+			otaError = "not enough space for update";
+		else if (!gzOta.begin(otaSha.writer()))
+			otaError = gzOta.error();
+	}
+
+	if (otaError.length() == 0 && !gzOta.write(data, len))
+		otaError = gzOta.error();
+	if (otaError.length() == 0)
+		onOTAProgress(index + len, request->contentLength());
+
+	if (final)
+	{
+		if (otaError.length() == 0 && !gzOta.finished())
+			otaError = gzOta.error();
+		// Verify hash of the inflated image before switching boot partition
+		if (otaError.length() == 0 && !otaSha.verify())
+			otaError = otaSha.error();
+		otaSha.end();
+
+		if (otaError.length() == 0 && !Update.end(true))
+			otaError = Update.errorString();
+		if (otaError.length() != 0)
+		{
+			Update.abort();
+			Serial.println("Compressed OTA error: " + otaError);
+		}
+		else
+			Serial.printf("Compressed OTA: %u bytes inflated to %u bytes\n", index + len, gzOta.outputSize());
+		gzOta.end();
+		onOTAEnd(otaError.length() == 0);
+	}
+}
+
+// Send page from storage, or built-in setup page if storage has no web pages
+void sendPage(AsyncWebServerRequest *request, const char *path)
+{
+	if (storage.exists(path))
+		request->send(storage, path);
+	else
+		request->send_P(200, "text/html", setupPage);
+}
+
+// OTA routes, registered in access point mode too so web pages can be uploaded after migration
+void addOtaRoutes()
+{
+	// Start ElegantOTA server for on air updates
+	ElegantOTA.begin(&server); // Start ElegantOTA
+	// ElegantOTA callbacks
+	ElegantOTA.onStart(onOTAStart);
+	ElegantOTA.onProgress(onOTAProgress);
+	ElegantOTA.onEnd(onOTAEnd);
+	// Compressed firmware upload
+	server.on(
+		"/ota/upload-gz", HTTP_POST, [](AsyncWebServerRequest *request)
+		{
+			if (otaError.length() == 0)
+			{
+				request->send(200, "text/plain", "OK");
+				reboot_millis = millis();
+			}
+			else
+				request->send(400, "text/plain", otaError); },
+		onGzOtaUpload);
+}
+
+// Restore settings files saved in NVS during migration, stash is kept until web pages are uploaded too
+void restoreMigratedFiles()
+{
+	Preferences prefs;
+	if (!prefs.begin("fsmigrate", false))
+		return;
+	for (int i = 0; i < 3; i++)
+	{
+		if (prefs.isKey(migrateKeys[i]) && !storage.exists(migratePaths[i]))
+		{
+			Serial.printf("Restore %s from migration stash\n", migratePaths[i]);
+			File file = storage.open(migratePaths[i], FILE_WRITE);
+			file.print(prefs.getString(migrateKeys[i]));
+			file.close();
+		}
+	}
+	if (storage.exists("/index.html"))
+		prefs.clear();
+	prefs.end();
+}
+
+// Init storage function, converts SPIFFS partition to LittleFS on first boot
+void initStorage()
+{
+	Serial.print("Mount LittleFS... ");
+	if (LittleFS.begin(false))
+	{
+		Serial.println("- succeeded");
+		restoreMigratedFiles();
+		return;
+	}
+	Serial.println("- failed");
+
+	// Both file systems use the same partition, so settings are stashed in NVS before formatting
+	Serial.print("Mount SPIFFS for migration... ");
+	if (SPIFFS.begin(false))
+	{
+		Serial.println("- succeeded");
+		Preferences prefs;
+		prefs.begin("fsmigrate", false);
+		for (int i = 0; i < 3; i++)
+		{
+			File file = SPIFFS.open(migratePaths[i]);
+			if (file)
+			{
+				Serial.printf("Stash %s: %u bytes\n", migratePaths[i], file.size());
+				prefs.putString(migrateKeys[i], file.readString());
+				file.close();
+			}
+		}
+		prefs.end();
+		SPIFFS.end();
+	}
+	else
+		Serial.println("- failed");
+
+	Serial.print("Format LittleFS... ");
+	if (!LittleFS.begin(true))
+	{
+		Serial.println("- failed");
+		return;
+	}
+	Serial.println("- succeeded");
+	restoreMigratedFiles();
+}
+
+// Read file from storage function
+DynamicJsonDocument readJsonFile(fs::FS &fs, const char *path, size_t capacity = 1024)
+{
+	Serial.printf("Read json file: %s", path);
+	DynamicJsonDocument doc(capacity);
+	File file = fs.open(path);
+	if (deserializeJson(doc, file) == DeserializationError::Ok)
+	{
+		Serial.println("- succeeded");
+	}
+	else
+		Serial.println("- failed");
+
+	return doc;
+}
+
+// Write file to storage function
+void writeJsonFile(fs::FS &fs, const char *path, DynamicJsonDocument json)
+{
+	Serial.printf("Save json file: %s\n", path);
+	Serial.println("File content: ");
+	serializeJson(json, Serial);
+
+	File file = fs.open(path, FILE_WRITE);
+	if (!file)
+	{
+		Serial.println("- error opening file for saving");
+		return;
+	}
+	if (serializeJson(json, file) != 0)
+		Serial.println("- succeeded");
+	else
+		Serial.println("- failed");
+
+	file.close();
+}
+
+// Pre-serialized document kept in a web socket buffer until the document changes. The snapshot
+// holds a reference on the buffer: lock() is a flag that textAll() clears, the count is not
+struct WsSnapshot
+{
+	DynamicJsonDocument *doc;
+	AsyncWebSocketMessageBuffer *buffer;
+};
+
+WsSnapshot shadeSnapshot = {&shadeDoc, nullptr};
+WsSnapshot timersSnapshot = {&timersDoc, nullptr};
+WsSnapshot networksSnapshot = {&networksDoc, nullptr};
+uint32_t wsBytesSent = 0;
+// Web socket sends, server buffer list and snapshot pointers are used from main loop and network task
+SemaphoreHandle_t wsMutex = NULL;
+
+// Send document to one client or to all clients when client is null
+void sendJson(const JsonDocument &doc, AsyncWebSocketClient *client)
+{
+	xSemaphoreTake(wsMutex, portMAX_DELAY);
+	AsyncWebSocketMessageBuffer *buffer = jsonBuffer(ws, doc);
+	if (!buffer)
+		Serial.println("No memory for web socket message");
+	else if (client)
+	{
+		wsBytesSent += buffer->length();
+		client->text(buffer);
+		// Server frees message buffers only in textAll(), sweep replies already sent
+		ws._cleanBuffers();
+	}
+	else
+	{
+		wsBytesSent += buffer->length() * ws.count();
+		ws.textAll(buffer);
+	}
+	xSemaphoreGive(wsMutex);
+}
+
+// Get serialized document, serialize only if document changed since last call. Caller holds wsMutex
+AsyncWebSocketMessageBuffer *snapshotBuffer(WsSnapshot &snapshot)
+{
+	if (!snapshot.buffer)
+	{
+		snapshot.buffer = jsonBuffer(ws, *snapshot.doc);
+		if (snapshot.buffer)
+			(*snapshot.buffer)++;
+	}
+	return snapshot.buffer;
+}
+
+// Drop snapshot reference, buffer is freed by the server when no message uses it. Caller holds wsMutex
+void releaseSnapshot(WsSnapshot &snapshot)
+{
+	if (snapshot.buffer)
+	{
+		(*snapshot.buffer)--;
+		snapshot.buffer = nullptr;
+	}
+}
+
+// Mark document as changed
+void invalidateSnapshot(WsSnapshot &snapshot)
+{
+	xSemaphoreTake(wsMutex, portMAX_DELAY);
+	releaseSnapshot(snapshot);
+	xSemaphoreGive(wsMutex);
+}
+
+// Send changed document to all clients
+void sendSnapshotAll(WsSnapshot &snapshot)
+{
+	xSemaphoreTake(wsMutex, portMAX_DELAY);
+	releaseSnapshot(snapshot);
+	AsyncWebSocketMessageBuffer *buffer = snapshotBuffer(snapshot);
+	if (buffer)
+	{
+		wsBytesSent += buffer->length() * ws.count();
+		ws.textAll(buffer);
+	}
+	xSemaphoreGive(wsMutex);
+}
+
+// Send current document to one client
+void sendSnapshot(WsSnapshot &snapshot, AsyncWebSocketClient *client)
+{
+	xSemaphoreTake(wsMutex, portMAX_DELAY);
+	AsyncWebSocketMessageBuffer *buffer = snapshotBuffer(snapshot);
+	if (buffer)
+	{
+		wsBytesSent += buffer->length();
+		client->text(buffer);
+	}
+	xSemaphoreGive(wsMutex);
+}
+
+// Record trace event, lock-free from any task
+void trace(uint8_t stage, uint16_t cmd, char phase)
+{
+	TraceEvent &e = traceRing[traceHead.fetch_add(1, std::memory_order_relaxed) & (TRACE_SIZE - 1)];
+	e.us = esp_timer_get_time();
+	e.cmd = cmd;
+	e.stage = stage;
+	e.phase = phase;
+	e.thread = xTaskGetCurrentTaskHandle() == loopTask ? 2 : 1;
+}
+
+// Wake main loop from task context
+void wakeLoop()
+{
+	if (loopTask)
+		xTaskNotifyGive(loopTask);
+}
+
+// Wake main loop from interrupt
+void IRAM_ATTR wakeLoopFromISR()
+{
+	BaseType_t woken = pdFALSE;
+	if (loopTask)
+		vTaskNotifyGiveFromISR(loopTask, &woken);
+	if (woken)
+		portYIELD_FROM_ISR();
+}
+
+// Checksum of RTC checkpoint without checksum field
+uint32_t checkpointChecksum(const PositionCheckpoint &cp)
+{
+	return crc32_le(0, (const uint8_t *)&cp, offsetof(PositionCheckpoint, checksum));
+}
+
+// Save current position to RTC memory, called on every motor step
+void saveRtcCheckpoint()
+{
+	rtcCheckpoint.magic = CHECKPOINT_MAGIC;
+	rtcCheckpoint.seq = ++checkpointSeq;
+	rtcCheckpoint.currentPos = currentPos;
+	rtcCheckpoint.shadeLenght = shadeLenght;
+	rtcCheckpoint.shade = shade;
+	rtcCheckpoint.checksum = checkpointChecksum(rtcCheckpoint);
+}
+
+// Invalidate RTC checkpoint when position is unknown (calibration)
+void clearRtcCheckpoint()
+{
+	rtcCheckpoint.magic = 0;
+	rtcCheckpoint.checksum = 0;
+}
+
+// Check RTC checkpoint after reset
+bool rtcCheckpointValid()
+{
+	if (esp_reset_reason() == ESP_RST_POWERON)
+		return false;
+	if (rtcCheckpoint.magic != CHECKPOINT_MAGIC || rtcCheckpoint.checksum != checkpointChecksum(rtcCheckpoint))
+		return false;
+	if (rtcCheckpoint.shadeLenght != shadeLenght || rtcCheckpoint.currentPos < 0 || rtcCheckpoint.currentPos > shadeLenght)
+		return false;
+	return true;
+}
+
+// Save current position to shade settings file
+void saveFlashCheckpoint()
+{
+	shadeDoc["currentPos"] = currentPos;
+	shadeDoc["seq"] = checkpointSeq;
+	invalidateSnapshot(shadeSnapshot);
+	writeJsonFile(storage, shadePath, shadeDoc);
+	checkpointMillis = millis();
+}
+
+// Save RTC checkpoint record to a small file while moving, no shade settings rewrite or serial dump
+void saveMovingCheckpoint()
+{
+	File file = storage.open(positionPath, FILE_WRITE);
+	if (!file || file.write((const uint8_t *)&rtcCheckpoint, sizeof(rtcCheckpoint)) != sizeof(rtcCheckpoint))
+		Serial.println("Position checkpoint write failed");
+	file.close();
+	checkpointMillis = millis();
+}
+
+// Position record saved while moving, valid if it matches current calibration
+bool readMovingCheckpoint(PositionCheckpoint &cp)
+{
+	File file = storage.open(positionPath, FILE_READ);
+	if (!file)
+		return false;
+	bool ok = file.read((uint8_t *)&cp, sizeof(cp)) == sizeof(cp);
+	file.close();
+	return ok && cp.magic == CHECKPOINT_MAGIC && cp.checksum == checkpointChecksum(cp) &&
+		   cp.shadeLenght == shadeLenght && cp.currentPos >= 0 && cp.currentPos <= shadeLenght;
+}
+
+// Current position in percent
+int positionPercent()
+{
+	return shadeLenght > 0 ? (int)((double)SHADE_MAX * currentPos / shadeLenght + 0.5) : 0;
+}
+
+// History page file name, pages are separate files so a record write rewrites only its page
+void historyPagePath(char *path, int page)
+{
+	sprintf(path, "/history%02d.bin", page);
+}
+
+// Write whole history page, creates the file if missing
+bool writeHistoryPage(int page, const uint8_t *buf)
+{
+	char path[20];
+	historyPagePath(path, page);
+	File file = storage.open(path, FILE_WRITE);
+	bool ok = file && file.write(buf, HISTORY_PAGE_SIZE) == HISTORY_PAGE_SIZE;
+	file.close();
+	return ok;
+}
+
+// Read whole history page, false if missing
+bool readHistoryPage(int page, uint8_t *buf)
+{
+	char path[20];
+	historyPagePath(path, page);
+	File file = storage.open(path, FILE_READ);
+	bool ok = file && file.read(buf, HISTORY_PAGE_SIZE) == HISTORY_PAGE_SIZE;
+	file.close();
+	return ok;
+}
+
+// Find newest history page, create erased pages if missing. Ring file of older firmware is split into pages
+void initHistory()
+{
+	uint8_t buf[HISTORY_PAGE_SIZE];
+	if (storage.exists(historyPath))
+	{
+		File old = storage.open(historyPath, FILE_READ);
+		if (old.size() == HISTORY_PAGES * HISTORY_PAGE_SIZE)
+		{
+			Serial.println("Split history file into pages...");
+			for (int i = 0; i < HISTORY_PAGES; i++)
+				if (old.read(buf, sizeof(buf)) == sizeof(buf))
+					writeHistoryPage(i, buf);
+		}
+		old.close();
+		storage.remove(historyPath);
+	}
+
+	bool found = false;
+	HistoryPageHeader header;
+	for (int i = 0; i < HISTORY_PAGES; i++)
+	{
+		if (!readHistoryPage(i, buf))
+		{
+			memset(buf, 0xFF, sizeof(buf));
+			writeHistoryPage(i, buf);
+			continue;
+		}
+		memcpy(&header, buf, sizeof(header));
+		if (header.magic != HISTORY_MAGIC)
+			continue;
+		if (!found || (int16_t)(header.seq - historySeq) > 0)
+		{
+			historyPage = i;
+			historySeq = header.seq;
+			historyBase = header.base;
+			found = true;
+		}
+	}
+	if (found && readHistoryPage(historyPage, buf))
+	{
+		HistoryRecord record;
+		for (historyCount = 0; historyCount < HISTORY_RECORDS; historyCount++)
+		{
+			memcpy(&record, buf + sizeof(HistoryPageHeader) + historyCount * sizeof(record), sizeof(record));
+			if (record.source == 0xFF)
+				break;
+		}
+	}
+	Serial.printf("History page %d, %d records\n", historyPage, historyCount);
+}
+
+// Queue finished move, it is written to flash later when motor is stopped
+void addHistory(uint32_t time, uint8_t source, uint8_t from, uint8_t to, uint8_t flags, unsigned long durationMillis)
+{
+	int next = (historyHead + 1) % HISTORY_PENDING;
+	if (next == historyTail)
+	{
+		Serial.println("History queue full, event dropped");
+		return;
+	}
+	HistoryEvent &event = historyPending[historyHead];
+	event.time = time;
+	event.record.source = source;
+	event.record.from = from;
+	event.record.to = to;
+	event.record.flags = flags;
+	event.record.duration = durationMillis / 100 > 0xFFFF ? 0xFFFF : durationMillis / 100;
+	historyHead = next;
+}
+
+// Write queued moves: one record in place in the current page file, or a new page over the oldest one
+void flushHistory()
+{
+	if (historyTail == historyHead)
+		return;
+
+	char path[20];
+	File file;
+	while (historyTail != historyHead)
+	{
+		HistoryEvent &event = historyPending[historyTail];
+		if (historyCount >= HISTORY_RECORDS || event.time < historyBase || event.time - historyBase > 0xFFFE)
+		{
+			file.close();
+			uint8_t page[HISTORY_PAGE_SIZE];
+			HistoryPageHeader header = {event.time, (uint16_t)(historySeq + 1), HISTORY_MAGIC};
+			memset(page, 0xFF, sizeof(page));
+			memcpy(page, &header, sizeof(header));
+			historyPage = (historyPage + 1) % HISTORY_PAGES;
+			historySeq = header.seq;
+			historyBase = header.base;
+			historyCount = 0;
+			if (!writeHistoryPage(historyPage, page))
+				Serial.println("History page write failed");
+		}
+		if (!file)
+		{
+			historyPagePath(path, historyPage);
+			file = storage.open(path, "r+");
+			if (!file)
+				return;
+		}
+		event.record.dt = event.time - historyBase;
+		file.seek(sizeof(HistoryPageHeader) + historyCount * sizeof(HistoryRecord));
+		file.write((uint8_t *)&event.record, sizeof(HistoryRecord));
+		historyCount++;
+		historyTail = (historyTail + 1) % HISTORY_PENDING;
+	}
+	file.close();
+}
+
+// Fill document with one page of records in time range, oldest first
+void historyToJson(JsonDocument &doc, uint32_t from, uint32_t to, int page)
+{
+	JsonArray records = doc.createNestedArray("history");
+	doc["page"] = page;
+	doc["more"] = false;
+
+	int skip = page * HISTORY_QUERY_PAGE;
+	uint8_t buf[HISTORY_PAGE_SIZE];
+	for (int i = 1; i <= HISTORY_PAGES; i++)
+	{
+		// Oldest page follows the newest one
+		if (!readHistoryPage((historyPage + i) % HISTORY_PAGES, buf))
+			continue;
+		HistoryPageHeader header;
+		memcpy(&header, buf, sizeof(header));
+		if (header.magic != HISTORY_MAGIC || header.base > to)
+			continue;
+		for (int j = 0; j < HISTORY_RECORDS; j++)
+		{
+			HistoryRecord record;
+			memcpy(&record, buf + sizeof(header) + j * sizeof(record), sizeof(record));
+			if (record.source == 0xFF)
+				break;
+			uint32_t time = header.base + record.dt;
+			if (time < from || time > to)
+				continue;
+			if (skip > 0)
+			{
+				skip--;
+				continue;
+			}
+			if (records.size() == HISTORY_QUERY_PAGE)
+			{
+				doc["more"] = true;
+				return;
+			}
+			JsonArray r = records.createNestedArray();
+			r.add(time);
+			r.add(record.source);
+			r.add(record.from);
+			r.add(record.to);
+			r.add(record.duration);
+			r.add(record.flags);
+		}
+	}
+}
+
+// Detect start and end of movement in main loop
+void trackMove()
+{
+	static int prevState = MOVE_STOP;
+	if (moveState == prevState)
+		return;
+	if (prevState == MOVE_STOP)
+	{
+		moveStartTime = time(nullptr);
+		moveStartMillis = millis();
+		moveFrom = positionPercent();
+	}
+	else if (moveState == MOVE_STOP)
+	{
+		addHistory(moveStartTime, moveSource, moveFrom, positionPercent(), moveStopped ? HIST_FLAG_STOPPED : 0, millis() - moveStartMillis);
+		moveStopped = false;
+	}
+	prevState = moveState;
+}
+
+// Read light settings from timers document
+void loadLightSettings()
+{
+	JsonObject light = timersDoc["light"];
+	LightSettings cfg;
+	cfg.enabled = light["enabled"] | false;
+	cfg.high = light["high"] | 3000;
+	cfg.low = light["low"] | 1500;
+	cfg.shadeBright = light["shadeBright"] | 100;
+	cfg.shadeDark = light["shadeDark"] | 0;
+	cfg.holdMs = (light["hold"] | 60) * 1000UL;
+	cfg.minIntervalMs = (light["interval"] | 600) * 1000UL;
+	portENTER_CRITICAL(&lightMux);
+	lightCfg = cfg;
+	portEXIT_CRITICAL(&lightMux);
+}
+
+// Read solar location from timers document
+void loadLocation()
+{
+	JsonObject location = timersDoc["location"];
+	latitude = location["lat"] | 54.93583;
+	longitude = location["lng"] | 43.32352;
+	tz = location["tz"] | 3;
+}
+
+// Sunrise-sunset API request for current location
+String sunriseUrl()
+{
+	return "https://api.sunrise-sunset.org/json?lat=" + String(latitude, 5) + "&lng=" + String(longitude, 5) + "&date=today";
+}
+
+// Light sensor task: blocks on ADC DMA, filters block averages, posts shade targets to main loop
+void lightTask(void *param)
+{
+	static uint16_t samples[LIGHT_DMA_LEN];
+	size_t bytes;
+	for (;;)
+	{
+		if (i2s_read(I2S_NUM_0, samples, sizeof(samples), &bytes, portMAX_DELAY) != ESP_OK || bytes < 2)
+			continue;
+		uint32_t sum = 0;
+		size_t n = bytes / 2;
+		for (size_t i = 0; i < n; i++)
+			sum += samples[i] & 0x0FFF;
+
+		LightSettings cfg;
+		portENTER_CRITICAL(&lightMux);
+		cfg = lightCfg;
+		portEXIT_CRITICAL(&lightMux);
+		int target = lightFilter.update(sum / n, millis(), cfg);
+		if (cfg.enabled && target >= 0)
+		{
+			lightShade = target;
+			wakeLoop();
+		}
+	}
+}
+
+// Start continuous ADC sampling of light sensor through I2S DMA
+void initLightSensor()
+{
+	i2s_config_t cfg = {};
+	cfg.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+	cfg.sample_rate = LIGHT_SAMPLE_RATE;
+	cfg.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+	cfg.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+	cfg.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+	cfg.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1;
+	cfg.dma_buf_count = 2;
+	cfg.dma_buf_len = LIGHT_DMA_LEN;
+
+	if (i2s_driver_install(I2S_NUM_0, &cfg, 0, NULL) != ESP_OK || i2s_set_adc_mode(ADC_UNIT_1, LIGHT_ADC_CHANNEL) != ESP_OK)
+	{
+		Serial.println("Light sensor init error");
+		return;
+	}
+	adc1_config_channel_atten(LIGHT_ADC_CHANNEL, ADC_ATTEN_DB_11);
+	i2s_adc_enable(I2S_NUM_0);
+	xTaskCreatePinnedToCore(lightTask, "light", 2048, NULL, 1, NULL, 0);
+	Serial.println("Light sensor started");
+}
+
+// Set shade target from schedule or sensor
+void setShadeTarget(int value, int source)
+{
+	motion.clear();
+	shade = value;
+	moveSource = source;
+	moveCmd = 0;
+}
+
+// Motor direction as seen by motion queue: 1 - down, -1 - up, 0 - stopped or calibrating
+int moveDirection()
+{
+	return moveState == MOVE_DOWN ? 1 : (moveState == MOVE_UP ? -1 : 0);
+}
+
+// Take next waypoint from motion queue when current target is reached
+void serviceMotionQueue()
+{
+	Waypoint next;
+	bool blended;
+	if (!motion.service(millis(), currentPos, shade, shadeLenght, moveDirection(), next, blended))
+		return;
+	shadeDoc["shade"] = shade;
+	invalidateSnapshot(shadeSnapshot);
+	moveSource = SRC_QUEUE;
+	Serial.printf("Waypoint: shade %d, dwell %d s, speed %d%s\n", next.shade, next.dwell, next.speed, blended ? ", blended" : "");
+}
+
+// Current queue as JSON: active waypoint first
+void queueToJson(JsonDocument &doc)
+{
+	JsonArray queue = doc.createNestedArray("queue");
+	Waypoint copy[MOTION_QUEUE_SIZE + 1];
+	int count = motion.copy(copy);
+	for (int i = 0; i < count; i++)
+	{
+		JsonArray a = queue.createNestedArray();
+		a.add(copy[i].shade);
+		a.add(copy[i].dwell);
+		a.add(copy[i].speed);
+	}
+}
+
+// Shade target changed by current command
+void motionCommand()
+{
+	commandMicros = micros();
+	motionCmd = traceCmd;
+}
+
+// Trace ring export in Chrome trace-event format, generated chunk by chunk
+struct TraceExport
+{
+	TraceEvent events[TRACE_SIZE];
+	int count;
+	int next;
+	char line[160];
+	size_t lineLen;
+	size_t lineOfs;
+
+	TraceExport()
+	{
+		uint32_t head = traceHead.load();
+		count = head < TRACE_SIZE ? head : TRACE_SIZE;
+		for (int i = 0; i < count; i++)
+			events[i] = traceRing[(head - count + i) & (TRACE_SIZE - 1)];
+		next = -1;
+		lineLen = lineOfs = 0;
+	}
+
+	// Format next line, returns false after the last one
+	bool nextLine()
+	{
+		if (next == -1)
+			lineLen = sprintf(line, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		else if (next == count)
+			lineLen = sprintf(line, "]}\n");
+		else if (next > count)
+			return false;
+		else
+		{
+			TraceEvent &e = events[next];
+			lineLen = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%u,%s\"args\":{\"cmd\":%u}}\n",
+							   next ? "," : "", traceStages[e.stage], e.phase, (long long)e.us, e.thread, e.phase == 'i' ? "\"s\":\"t\"," : "", e.cmd);
+		}
+		next++;
+		lineOfs = 0;
+		return true;
+	}
+
+	// Fill response chunk, returns 0 at the end
+	size_t fill(uint8_t *buffer, size_t maxLen)
+	{
+		size_t len = 0;
+		while (len < maxLen)
+		{
+			if (lineOfs == lineLen && !nextLine())
+				break;
+			size_t n = min(maxLen - len, lineLen - lineOfs);
+			memcpy(buffer + len, line + lineOfs, n);
+			len += n;
+			lineOfs += n;
+		}
+		return len;
+	}
+};
+
+// Check network settings: SSID is required, addresses are either all empty for DHCP or valid static config
+bool validateNetworkSettings(JsonObject cmd, String &error)
+{
+	if (cmd["ssid"].as<String>().length() == 0)
+	{
+		error = "auth: ssid is missing";
+		return false;
+	}
+	const char *fields[] = {"ip", "gateway", "dns", "subnet"};
+	IPAddress addr[4];
+	int empty = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		String value = cmd[fields[i]].as<String>();
+		if (cmd[fields[i]].isNull() || value.length() == 0)
+			empty++;
+		else if (!addr[i].fromString(value))
+		{
+			error = "auth: invalid " + String(fields[i]) + " address";
+			return false;
+		}
+	}
+	if (empty != 0 && empty != 4)
+	{
+		error = "auth: ip, gateway, dns and subnet must be all set or all empty";
+		return false;
+	}
+	if (empty == 0 && ((uint32_t)addr[0] & (uint32_t)addr[3]) != ((uint32_t)addr[1] & (uint32_t)addr[3]))
+	{
+		error = "auth: gateway is not in ip subnet";
+		return false;
+	}
+	return true;
+}
+
+// Settings currently used by station
+NetworkSettings currentNetworkSettings()
+{
+	NetworkSettings ns;
+	ns.ssid = cs.ssid;
+	ns.pass = cs.pass;
+	ns.ip = cs.ip;
+	ns.gateway = cs.gateway;
+	ns.dns = cs.dns;
+	ns.subnet = cs.subnet;
+	return ns;
+}
+
+// Copy settings to connection document, connection settings point to document strings
+void setConnectionSettings(const NetworkSettings &ns)
+{
+	csDoc["ssid"] = ns.ssid;
+	csDoc["pass"] = ns.pass;
+	csDoc["ip"] = ns.ip;
+	csDoc["gateway"] = ns.gateway;
+	csDoc["dns"] = ns.dns;
+	csDoc["subnet"] = ns.subnet;
+	csDoc.garbageCollect();
+	cs.ssid = csDoc["ssid"];
+	cs.pass = csDoc["pass"];
+	cs.ip = csDoc["ip"];
+	cs.gateway = csDoc["gateway"];
+	cs.dns = csDoc["dns"];
+	cs.subnet = csDoc["subnet"];
+}
+
+// Address from settings, empty field gives 0.0.0.0 so station goes back to DHCP
+IPAddress settingsAddress(const String &value)
+{
+	IPAddress addr((uint32_t)0);
+	if (value.length())
+		addr.fromString(value);
+	return addr;
+}
+
+// Station lost old association, called from WiFi event task
+void onWiFiDisconnected(arduino_event_id_t event)
+{
+	netDropped = true;
+}
+
+// Station is associated with the given settings and not still with the previous network
+bool connectedTo(const NetworkSettings &ns)
+{
+	if (!netDropped || WiFi.status() != WL_CONNECTED || WiFi.SSID() != ns.ssid)
+		return false;
+	return ns.ip.length() == 0 || WiFi.localIP() == localIP;
+}
+
+// Reconnect station with settings, does not wait for connection
+void beginNetwork(const NetworkSettings &ns)
+{
+	localIP = settingsAddress(ns.ip);
+	localGateway = settingsAddress(ns.gateway);
+	localSubnet = settingsAddress(ns.subnet);
+	localDNS = settingsAddress(ns.dns);
+	// Without an association there is no disconnect event to wait for
+	netDropped = WiFi.status() != WL_CONNECTED;
+	WiFi.disconnect();
+	if (!WiFi.config(localIP, localGateway, localSubnet, localDNS))
+		Serial.println("Config WiFi error");
+	WiFi.begin(ns.ssid.c_str(), ns.pass.c_str());
+}
+
+// Notify clients about network change. IP is empty while a DHCP address is not known yet, clients use
+// the mDNS host then. "applied" and "rolledBack" are sent after reassociation, so only clients that
+// reconnected in time get them
+void sendNetworkStatus(const char *status, const String &ip)
+{
+	DynamicJsonDocument doc(256);
+	JsonObject network = doc.createNestedObject("network");
+	network["status"] = status;
+	network["ip"] = ip;
+	network["host"] = MDNS_NAME ".local";
+	sendJson(doc, nullptr);
+}
+
+// Apply new network settings in main loop: try new settings, roll back to old ones on timeout.
+// Motor, calibration and web server keep running
+void serviceNetwork()
+{
+	switch (netState)
+	{
+	case NET_APPLY:
+		// Give clients time to receive notification before disconnect
+		if ((long)(millis() - netDeadline) < 0)
+			break;
+		Serial.println("Apply network settings, SSID: " + netNew.ssid + ", IP: " + netNew.ip);
+		netOld = currentNetworkSettings();
+		beginNetwork(netNew);
+		netDeadline = millis() + NET_APPLY_TIMEOUT;
+		netState = NET_TRYING;
+		break;
+
+	case NET_TRYING:
+		if (connectedTo(netNew))
+		{
+			Serial.print("Network settings applied, local IP: ");
+			Serial.println(WiFi.localIP());
+			setConnectionSettings(netNew);
+			writeJsonFile(storage, csPath, csDoc);
+			sendNetworkStatus("applied", WiFi.localIP().toString());
+			netState = NET_IDLE;
+		}
+		else if ((long)(millis() - netDeadline) >= 0)
+		{
+			Serial.println("Network settings timeout, roll back");
+			beginNetwork(netOld);
+			netDeadline = millis() + NET_APPLY_TIMEOUT;
+			netState = NET_ROLLBACK;
+		}
+		break;
+
+	case NET_ROLLBACK:
+		if (connectedTo(netOld))
+		{
+			Serial.println("Network settings rolled back");
+			sendNetworkStatus("rolledBack", WiFi.localIP().toString());
+			netState = NET_IDLE;
+		}
+		else if ((long)(millis() - netDeadline) >= 0)
+		{
+			Serial.println("Network rollback timeout. Rebooting...");
+			ESP.restart();
+		}
+		break;
+	}
+}
+
+// Timer is [id, hour, min, shade]
+bool validTimer(JsonArray timer)
+{
+	return !timer.isNull() && timer.size() >= 4 && timer[1].as<int>() >= 0 && timer[1].as<int>() <= 23 &&
+		   timer[2].as<int>() >= 0 && timer[2].as<int>() <= 59 && timer[3].as<int>() >= 0 && timer[3].as<int>() <= SHADE_MAX;
+}
+
+// Light thresholds in ADC units, shades in percent, hold and interval in seconds
+bool validLight(JsonObject light)
+{
+	return light["high"].as<int>() >= 0 && light["high"].as<int>() <= 4095 && light["low"].as<int>() >= 0 && light["low"].as<int>() < light["high"].as<int>() &&
+		   light["shadeBright"].as<int>() >= 0 && light["shadeBright"].as<int>() <= SHADE_MAX && light["shadeDark"].as<int>() >= 0 && light["shadeDark"].as<int>() <= SHADE_MAX &&
+		   light["hold"].as<int>() >= 0 && light["interval"].as<int>() >= 0;
+}
+
+// Expected state after already validated commands of a batch
+struct BatchCheck
+{
+	std::vector<String> timerIds; // Timer ids after the commands
+	int queued;					  // Waypoints in motion queue after the commands
+	bool calibrated;			  // Shade is calibrated after the commands
+	bool timersChanged;			  // Commands edit timers document
+};
+
+// Batch check starts from current timers, motion queue and calibration
+void beginBatchCheck(BatchCheck &batch)
+{
+	for (JsonVariant timer : timersArray)
+		batch.timerIds.push_back(timer[0].as<String>());
+	batch.queued = motion.count();
+	batch.calibrated = calibrateStatus == "true";
+	batch.timersChanged = false;
+}
+
+// Check command fields before anything is applied, batch is updated with the expected result of the command
+bool validateCommand(JsonObject cmd, BatchCheck &batch, String &error)
+{
+	const char *name = cmd["cmd"];
+	if (name == nullptr)
+	{
+		error = "command name is missing";
+		return false;
+	}
+	String c = name;
+
+	if (c == "auth")
+		return validateNetworkSettings(cmd, error);
+	// Direct moves and stop replace the motion queue, calibration run leaves shade uncalibrated until it ends
+	if (c == "open" || c == "close" || c == "calibrate" || c == "stop" || c == "clearQueue")
+	{
+		batch.queued = 0;
+		if (c == "calibrate")
+			batch.calibrated = false;
+		return true;
+	}
+	if (c == "getTimers" || c == "getStats" || c == "getQueue")
+		return true;
+	if (c == "setShade" || c == "addSunrise" || c == "addSunset")
+	{
+		batch.timersChanged |= c != "setShade";
+		const char *field = c == "setShade" ? "shade" : (c == "addSunrise" ? "shadeSunrise" : "shadeSunset");
+		if (cmd[field].isNull() || cmd[field].as<int>() < 0 || cmd[field].as<int>() > SHADE_MAX)
+		{
+			error = c + ": " + field + " must be 0.." + String(SHADE_MAX);
+			return false;
+		}
+		if (c == "setShade")
+			batch.queued = 0;
+		return true;
+	}
+	if (c == "queueShade")
+	{
+		JsonArray points = cmd["points"];
+		if (!batch.calibrated)
+		{
+			error = "queueShade: shade is not calibrated";
+			return false;
+		}
+		// Waypoints are added after the ones already queued unless clear is set
+		int queued = (cmd["clear"] | false) ? 0 : batch.queued;
+		if (points.isNull() || points.size() == 0 || queued + (int)points.size() > MOTION_QUEUE_SIZE)
+		{
+			error = "queueShade: points must have 1 or more waypoints, " + String(MOTION_QUEUE_SIZE - queued) + " of " + String(MOTION_QUEUE_SIZE) + " queue slots free";
+			return false;
+		}
+		for (JsonObject p : points)
+		{
+			int speed = p["speed"] | 0;
+			if (p["shade"].isNull() || p["shade"].as<int>() < 0 || p["shade"].as<int>() > SHADE_MAX || p["dwell"].as<int>() < 0 ||
+				p["dwell"].as<int>() > 3600 || (speed != 0 && (speed < Hw::minSpeed || speed > Hw::maxSpeed)))
+			{
+				error = "queueShade: waypoint needs shade 0.." + String(SHADE_MAX) + ", dwell 0..3600 s, speed " + String(Hw::minSpeed) + ".." + String(Hw::maxSpeed);
+				return false;
+			}
+		}
+		batch.queued = queued + points.size();
+		return true;
+	}
+	if (c == "setLight")
+	{
+		if (!validLight(cmd))
+		{
+			error = "setLight: need 0 <= low < high <= 4095, shades 0..100, hold and interval in seconds";
+			return false;
+		}
+		return true;
+	}
+	if (c == "getHistory")
+	{
+		if (cmd["page"].as<int>() < 0)
+		{
+			error = "getHistory: page must be positive";
+			return false;
+		}
+		return true;
+	}
+	if (c == "addTimer")
+	{
+		if (!validTimer(cmd["timer"]))
+		{
+			error = "addTimer: timer must be [id, hour, min, shade]";
+			return false;
+		}
+		if (batch.timerIds.size() >= MAX_TIMERS)
+		{
+			error = "addTimer: too many timers";
+			return false;
+		}
+		batch.timerIds.push_back(cmd["timer"][0].as<String>());
+		batch.timersChanged = true;
+		return true;
+	}
+	if (c == "deleteTimer")
+	{
+		if (cmd["id"].isNull())
+		{
+			error = "deleteTimer: id is missing";
+			return false;
+		}
+		// Ids deleted or added earlier in the batch are taken into account
+		String id = cmd["id"].as<String>();
+		for (int i = batch.timerIds.size() - 1; i >= 0; i--)
+			if (batch.timerIds[i] == id)
+				batch.timerIds.erase(batch.timerIds.begin() + i);
+		batch.timersChanged = true;
+		return true;
+	}
+
+	error = "unknown command: " + c;
+	return false;
+}
+
+// Apply timer command to a timers document. Removed values stay in the pool, so deleting
+// rebuilds the document to keep free space for timers added later in the batch
+void editTimers(JsonObject cmd, DynamicJsonDocument &timers)
+{
+	if (cmd["cmd"] == "addSunset")
+	{
+		timers["onSunset"] = true;
+		timers["shadeSunset"] = cmd["shadeSunset"];
+	}
+	if (cmd["cmd"] == "addSunrise")
+	{
+		timers["onSunrise"] = true;
+		timers["shadeSunrise"] = cmd["shadeSunrise"];
+	}
+	if (cmd["cmd"] == "addTimer")
+		timers["timers"].add(cmd["timer"]);
+	if (cmd["cmd"] == "deleteTimer")
+	{
+		JsonArray list = timers["timers"];
+		for (int i = list.size() - 1; i >= 0; i--)
+			if (list[i][0].as<String>() == cmd["id"].as<String>())
+				list.remove(i);
+		if (cmd["time"] == "Восход")
+			timers["onSunrise"] = false;
+		if (cmd["time"] == "Закат")
+			timers["onSunset"] = false;
+		DynamicJsonDocument compact(timers.capacity());
+		compact.set(timers);
+		timers.set(compact);
+	}
+}
+
+// Build timers document after the commands in a fresh pool, false if it does not fit
+bool buildTimers(JsonVariant cmds, DynamicJsonDocument &timersNew, String &error)
+{
+	timersNew.set(timersDoc);
+	if (cmds.is<JsonObject>())
+		editTimers(cmds.as<JsonObject>(), timersNew);
+	else
+		for (JsonVariant cmd : cmds.as<JsonArray>())
+			editTimers(cmd.as<JsonObject>(), timersNew);
+	if (timersNew.overflowed())
+	{
+		error = "timers do not fit " + String(timersDoc.capacity()) + " bytes";
+		return false;
+	}
+	return true;
+}
+
+// Replace timers document, caller holds timersMutex
+void swapTimers(DynamicJsonDocument &timersNew)
+{
+	timersDoc.set(timersNew);
+	timersArray = timersDoc["timers"];
+	nTimers = timersArray.size();
+	onSunrise = timersDoc["onSunrise"] | false;
+	onSunset = timersDoc["onSunset"] | false;
+}
+
+// Apply validated command, returns stores to save and documents to send. Timer commands
+// are already in timers document built by buildTimers()
+uint8_t applyCommand(JsonObject doc, AsyncWebSocketClient *client)
+{
+	uint8_t changes = 0;
+
+	if (doc["cmd"] == "auth")
+	{
+		NetworkSettings ns;
+		ns.ssid = doc["ssid"].as<String>();
+		ns.pass = doc["pass"] | "";
+		ns.ip = doc["ip"] | "";
+		ns.gateway = doc["gateway"] | "";
+		ns.dns = doc["dns"] | "";
+		ns.subnet = doc["subnet"] | "";
+		Serial.println("Set SSID: " + ns.ssid);
+		Serial.println("Set IP: " + ns.ip);
+		Serial.println("Set gateway: " + ns.gateway);
+		Serial.println("Set DNS: " + ns.dns);
+		Serial.println("Set subnet mask: " + ns.subnet);
+
+		if (!init_flag)
+		{
+			// First setup from access point: save and reboot to station mode
+			setConnectionSettings(ns);
+			changes |= STORE_CONNECTION | DO_RESTART;
+		}
+		else
+		{
+			// Connected: apply in main loop, settings are saved only when connection succeeds
+			netNew = ns;
+			netDeadline = millis() + 500;
+			netState = NET_APPLY;
+			sendNetworkStatus("applying", ns.ip);
+		}
+	}
+	if (doc["cmd"] == "open")
+	{
+		Serial.print("Request from client to open...\n");
+		if (calibrateStatus == "true")
+		{
+			// Set zero position
+			motion.clear();
+			shade = 0;
+			moveSource = SRC_CLIENT;
+			motionCommand();
+			shadeDoc["shade"] = shade;
+			changes |= SEND_SHADE;
+		}
+	}
+
+	if (doc["cmd"] == "close")
+	{
+		Serial.print("Request from client to close...\n");
+		if (calibrateStatus == "true")
+		{
+			// Set max position
+			motion.clear();
+			shade = SHADE_MAX;
+			moveSource = SRC_CLIENT;
+			motionCommand();
+			shadeDoc["shade"] = shade;
+			changes |= SEND_SHADE;
+		}
+	}
+
+	if (doc["cmd"] == "calibrate")
+	{
+		Serial.print("Request from client to calibrate shade lenght...\n");
+		motion.clear();
+		moveState = MOVE_CALIBRATE;
+		moveSource = SRC_CALIBRATE;
+		calibrateStatus = "progress";
+		shadeDoc["calibrateStatus"] = calibrateStatus;
+		calibrateCnt = 0;
+		clearRtcCheckpoint();
+		motionCommand();
+		changes |= SEND_SHADE;
+	}
+
+	if (doc["cmd"] == "stop")
+	{
+		Serial.print("Request from client to stop motor...\n");
+		moveStopped = moveState != MOVE_STOP;
+		moveState = MOVE_STOP;
+		motion.clear();
+		if (calibrateStatus == "progress")
+		{
+			calibrateStatus = "false";
+			shadeDoc["calibrateStatus"] = calibrateStatus;
+			changes |= STORE_SHADE | SEND_SHADE;
+		}
+		if (calibrateStatus == "true")
+		{
+			// Set current position as target and save to file
+			targetPos = currentPos;
+			shade = posToShade(targetPos, shadeLenght);
+			shadeDoc["targetPos"] = targetPos;
+			shadeDoc["shade"] = shade;
+			saveRtcCheckpoint();
+			changes |= STORE_SHADE | SEND_SHADE;
+		}
+	}
+
+	if (doc["cmd"] == "setShade")
+	{
+		Serial.printf("Request from client to set manual shade position: %d...\n", doc["shade"].as<int>());
+		motion.clear();
+		shade = doc["shade"];
+		moveSource = SRC_CLIENT;
+		shadeDoc["shade"] = shade;
+		motionCommand();
+		changes |= SEND_SHADE;
+	}
+
+	if (doc["cmd"] == "addSunset")
+	{
+		Serial.printf("Request from client to set shade position: %d on sunset...\n", doc["shadeSunset"].as<int>());
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
+
+	if (doc["cmd"] == "addSunrise")
+	{
+		Serial.printf("Request from client to set shade position: %d on sunrise...\n", doc["shadeSunrise"].as<int>());
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
+
+	if (doc["cmd"] == "addTimer")
+	{
+		Serial.printf("Request from client to add new timer id: %s...\n", doc["timer"][0].as<String>());
+		Serial.printf("Number of timers: %d\n", nTimers);
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
+
+	// If delete timer message received
+	if (doc["cmd"] == "deleteTimer")
+	{
+		Serial.printf("Request from client to remove timer id %s at %s ...\n", doc["id"].as<String>(), doc["time"].as<String>());
+		Serial.printf("Number of timers: %d\n", nTimers);
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
+	// If get timers message received
+	if (doc["cmd"] == "getTimers")
+	{
+		Serial.printf("Request from client number of timers...\n");
+		nTimers = timersArray.size();
+		Serial.printf("Number of timers: %d\n", nTimers);
+		changes |= SEND_TIMERS;
+	}
+	// Motion queue commands
+	if (doc["cmd"] == "queueShade")
+	{
+		Serial.printf("Request from client to queue %u waypoints...\n", doc["points"].size());
+		if (doc["clear"] | false)
+			motion.clear();
+		if (calibrateStatus == "true")
+		{
+			for (JsonObject p : doc["points"].as<JsonArray>())
+			{
+				Waypoint wp = {p["shade"].as<uint8_t>(), p["dwell"] | (uint16_t)0, p["speed"] | (uint16_t)0};
+				if (!motion.enqueue(wp))
+				{
+					Serial.println("Motion queue full");
+					break;
+				}
+			}
+			motionCommand();
+		}
+		changes |= SEND_QUEUE;
+	}
+	if (doc["cmd"] == "clearQueue")
+	{
+		Serial.print("Request from client to clear motion queue...\n");
+		motion.clear();
+		changes |= SEND_QUEUE;
+	}
+	if (doc["cmd"] == "getQueue")
+		changes |= SEND_QUEUE;
 
-void onOTAStart()
-{
-	// Log when OTA has started
-	Serial.println("OTA update started!");
-}
+	// If light settings message received
+	if (doc["cmd"] == "setLight")
+	{
+		Serial.printf("Request from client to set light thresholds: %d..%d\n", doc["low"].as<int>(), doc["high"].as<int>());
+		JsonObject light = timersDoc["light"];
+		if (light.isNull())
+			light = timersDoc.createNestedObject("light");
+		light["enabled"] = doc["enabled"].as<bool>();
+		light["high"] = doc["high"].as<int>();
+		light["low"] = doc["low"].as<int>();
+		light["shadeBright"] = doc["shadeBright"].as<int>();
+		light["shadeDark"] = doc["shadeDark"].as<int>();
+		light["hold"] = doc["hold"].as<int>();
+		light["interval"] = doc["interval"].as<int>();
+		loadLightSettings();
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
 
-void onOTAProgress(size_t current, size_t final)
-{
-	// Log every 1 second
-	if (millis() - ota_progress_millis > 1000)
+	// If get history message received, reply only to requesting client
+	if (doc["cmd"] == "getHistory")
 	{
-		ota_progress_millis = millis();
-		Serial.printf("OTA Progress Current: %u bytes, Final: %u bytes\n", current, final);
+		DynamicJsonDocument reply(3072);
+		historyToJson(reply, doc["from"] | 0, doc["to"] | 0xFFFFFFFF, doc["page"] | 0);
+		sendJson(reply, client);
 	}
+	// If get stats message received
+	if (doc["cmd"] == "getStats")
+		changes |= SEND_STATS;
+
+	return changes;
 }
 
-void onOTAEnd(bool success)
+// Save every changed store once and send every changed document once
+void commitChanges(uint8_t changes, AsyncWebSocketClient *client)
 {
-	// Log when OTA has finished
-	if (success)
+	trace(TR_PERSIST, traceCmd, 'B');
+	if (changes & STORE_CONNECTION)
+		writeJsonFile(storage, csPath, csDoc);
+	if (changes & STORE_SHADE)
+		saveFlashCheckpoint();
+	if (changes & STORE_TIMERS)
+		writeJsonFile(storage, timersPath, timersDoc);
+	trace(TR_PERSIST, traceCmd, 'E');
+
+	trace(TR_BROADCAST, traceCmd, 'B');
+	if (changes & SEND_SHADE)
 	{
-		Serial.println("OTA update finished successfully!");
+		// Serialize JSON object and send to all clients
+		sendSnapshotAll(shadeSnapshot);
 	}
-	else
+	if (changes & SEND_TIMERS)
 	{
-		Serial.println("There was an error during OTA update!");
+		serializeJson(timersDoc, Serial);
+		Serial.println();
+		sendSnapshotAll(timersSnapshot);
 	}
-	// <Add your own code here>
+	if (changes & SEND_QUEUE)
+	{
+		DynamicJsonDocument doc(1024);
+		queueToJson(doc);
+		sendJson(doc, nullptr);
+	}
+	trace(TR_BROADCAST, traceCmd, 'E');
+
+	// Server statistics are sent only to requesting client
+	if (changes & SEND_STATS)
+	{
+		DynamicJsonDocument doc(256);
+		JsonObject stats = doc.createNestedObject("stats");
+		stats["heap"] = ESP.getFreeHeap();
+		stats["minHeap"] = ESP.getMinFreeHeap();
+		stats["maxAlloc"] = ESP.getMaxAllocHeap();
+		stats["clients"] = ws.count();
+		stats["uptime"] = millis();
+		stats["bytesSent"] = wsBytesSent;
+		stats["light"] = lightFilter.level >> 8;
+		sendJson(doc, client);
+	}
+
+	// Reboot from main loop after response is sent
+	if (changes & DO_RESTART)
+		reboot_millis = millis();
 }
 
-// Init SPIFFS function
-void initSPIFFS()
+// Device state blob: header, then sections of type, length and MessagePack payload.
+// Integers are little endian, CRC32 covers everything after the header
+struct StateHeader
 {
-	Serial.print("Mount SPIFFS... ");
-	if (!SPIFFS.begin(true))
-		Serial.println("- failed");
-	else
-		Serial.println("- succeeded");
-}
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sections;
+	uint32_t length; // Bytes after header
+	uint32_t crc;
+};
 
-// Read file from SPIFFS function
-DynamicJsonDocument readJsonFile(fs::FS &fs, const char *path)
+struct StateSection
 {
-	Serial.printf("Read json file: %s", path);
-	DynamicJsonDocument doc(1024);
-	File file = fs.open(path);
-	if (deserializeJson(doc, file) == DeserializationError::Ok)
+	uint8_t type; // SEC_*
+	uint8_t reserved;
+	uint16_t length;
+};
+
+const char *stateSections[] = {"", "connection", "calibration", "timers", "location", "tuning"};
+
+// Current settings of one state section, WiFi password only with secrets
+void stateSectionToJson(uint8_t type, JsonDocument &doc, bool secrets)
+{
+	switch (type)
 	{
-		Serial.println("- succeeded");
+	case SEC_CONNECTION:
+		doc["ssid"] = cs.ssid;
+		if (secrets)
+			doc["pass"] = cs.pass;
+		doc["ip"] = cs.ip;
+		doc["gateway"] = cs.gateway;
+		doc["dns"] = cs.dns;
+		doc["subnet"] = cs.subnet;
+		break;
+	case SEC_CALIBRATION:
+		doc["shadeLenght"] = shadeLenght;
+		doc["calibrateStatus"] = calibrateStatus;
+		break;
+	case SEC_TIMERS:
+		doc["timers"] = timersArray;
+		doc["onSunrise"] = onSunrise;
+		doc["onSunset"] = onSunset;
+		doc["shadeSunrise"] = timersDoc["shadeSunrise"];
+		doc["shadeSunset"] = timersDoc["shadeSunset"];
+		break;
+	case SEC_LOCATION:
+		doc["lat"] = latitude;
+		doc["lng"] = longitude;
+		doc["tz"] = tz;
+		break;
+	case SEC_TUNING:
+		doc["light"] = timersDoc["light"];
+		break;
 	}
-	else
-		Serial.println("- failed");
-
-	return doc;
 }
 
-// Write file to SPIFFS function
-void writeJsonFile(fs::FS &fs, const char *path, DynamicJsonDocument json)
+// Build state blob with sections selected by mask bit (1 << SEC_*), returns size or 0 with error
+size_t exportState(uint8_t *buf, size_t size, uint8_t mask, bool secrets, String &error)
 {
-	Serial.printf("Save json file: %s\n", path);
-	Serial.println("File content: ");
-	serializeJson(json, Serial);
-
-	File file = fs.open(path, FILE_WRITE);
-	if (!file)
+	StateHeader header = {STATE_MAGIC, STATE_VERSION, 0, 0, 0};
+	size_t len = sizeof(header);
+	for (uint8_t type = SEC_CONNECTION; type <= SEC_TUNING; type++)
 	{
-		Serial.println("- error opening file for saving");
-		return;
+		if (!(mask & (1 << type)))
+			continue;
+		DynamicJsonDocument doc(4096);
+		stateSectionToJson(type, doc, secrets);
+		if (doc.overflowed())
+		{
+			error = "state: " + String(stateSections[type]) + " section does not fit " + String(doc.capacity()) + " bytes";
+			return 0;
+		}
+		StateSection section = {type, 0, (uint16_t)measureMsgPack(doc)};
+		if (len + sizeof(section) + section.length + 1 > size)
+		{
+			error = "state: blob larger than " + String(size) + " bytes";
+			return 0;
+		}
+		memcpy(buf + len, &section, sizeof(section));
+		len += sizeof(section);
+		serializeMsgPack(doc, buf + len, size - len);
+		len += section.length;
+		header.sections++;
 	}
-	if (serializeJson(json, file) != 0)
-		Serial.println("- succeeded");
-	else
-		Serial.println("- failed");
-
-	file.close();
+	header.length = len - sizeof(header);
+	header.crc = crc32_le(0, buf + sizeof(header), header.length);
+	memcpy(buf, &header, sizeof(header));
+	return len;
 }
 
-// Handle web socket message WS_EVT_DATA
-void handleWebSocketMessage(void *arg, uint8_t *data, size_t len)
+// Check whole blob and every known section, then apply all sections at once.
+// Sections missing from the blob keep current settings, unknown sections are skipped
+bool importState(const uint8_t *buf, size_t len, String &error)
 {
-	AwsFrameInfo *info = (AwsFrameInfo *)arg;
-	if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT)
+	StateHeader header;
+	if (len < sizeof(header))
 	{
-		data[len] = 0;
-		String msg = (char *)data;
-		Serial.println("WebSocket message received: " + msg);
+		error = "state: blob too short";
+		return false;
+	}
+	memcpy(&header, buf, sizeof(header));
+	if (header.magic != STATE_MAGIC || header.version != STATE_VERSION)
+	{
+		error = "state: unknown format or version " + String(header.version);
+		return false;
+	}
+	if (header.length != len - sizeof(header) || header.crc != crc32_le(0, buf + sizeof(header), header.length))
+	{
+		error = "state: length or checksum mismatch";
+		return false;
+	}
 
-		// Deserialize JSON object from string
-		DynamicJsonDocument doc(1024);
-		if (deserializeJson(doc, msg) == DeserializationError::Ok)
+	// Decode sections into one staging document keyed by section name
+	DynamicJsonDocument state(8192);
+	size_t ofs = sizeof(header);
+	for (int i = 0; i < header.sections; i++)
+	{
+		StateSection section;
+		if (ofs + sizeof(section) > len)
 		{
-			if (doc["cmd"] == "auth")
-			{
-				cs.ssid = doc["ssid"];
-				csDoc["ssid"] = cs.ssid;
-				Serial.println("Set SSID: " + String(cs.ssid));
-				cs.pass = doc["pass"];
-				csDoc["pass"] = cs.pass;
-				Serial.println("Set password: " + String(cs.pass));
-				cs.ip = doc["ip"];
-				csDoc["ip"] = cs.ip;
-				Serial.println("Set IP: " + String(cs.ssid));
-				cs.gateway = doc["gateway"];
-				csDoc["gateway"] = cs.gateway;
-				Serial.println("Set gateway: " + String(cs.gateway));
-				cs.dns = doc["dns"];
-				csDoc["dns"] = cs.dns;
-				Serial.println("Set DNS: " + String(cs.dns));
-				cs.subnet = doc["subnet"];
-				csDoc["subnet"] = cs.subnet;
-				Serial.println("Set subnet mask: " + String(cs.subnet));
-				writeJsonFile(SPIFFS, csPath, csDoc);
-
-				shadeDoc["shadeLenght"] = 0;
-				shadeDoc["targetPos"] = 0;
-				shadeDoc["shade"] = 0;
-				shadeDoc["calibrateStatus"] = "false";
-				writeJsonFile(SPIFFS, shadePath, shadeDoc);
-
-				delay(3000);
-				Serial.println("ESP rebooting...");
-				ESP.restart();
-			}
-			if (doc["cmd"] == "open")
+			error = "state: truncated section header";
+			return false;
+		}
+		memcpy(&section, buf + ofs, sizeof(section));
+		ofs += sizeof(section);
+		if (ofs + section.length > len)
+		{
+			error = "state: truncated section";
+			return false;
+		}
+		if (section.type >= SEC_CONNECTION && section.type <= SEC_TUNING)
+		{
+			DynamicJsonDocument doc(4096);
+			if (deserializeMsgPack(doc, buf + ofs, section.length) != DeserializationError::Ok || !doc.is<JsonObject>())
 			{
-				Serial.print("Request from client to open...\n");
-				if (calibrateStatus == "true")
-				{
-					// Set zero position
-					shade = 0;
-					shadeDoc["shade"] = shade;
-
-					// Serialize JSON object to string and send to client
-					ws_len = serializeJson(shadeDoc, ws_data);
-					ws.textAll(ws_data, ws_len);
-				}
+				error = "state: bad " + String(stateSections[section.type]) + " section";
+				return false;
 			}
+			state[stateSections[section.type]] = doc.as<JsonObject>();
+		}
+		ofs += section.length;
+	}
+	if (state.overflowed())
+	{
+		error = "state: sections too large";
+		return false;
+	}
 
-			if (doc["cmd"] == "close")
-			{
-				Serial.print("Request from client to close...\n");
-				if (calibrateStatus == "true")
-				{
-					// Set max position
-					shade = 100;
-					shadeDoc["shade"] = shade;
-
-					// Serialize JSON object to string and send to client
-					ws_len = serializeJson(shadeDoc, ws_data);
-					ws.textAll(ws_data, ws_len);
-				}
-			}
+	JsonObject connection = state["connection"];
+	JsonObject calibration = state["calibration"];
+	JsonObject timers = state["timers"];
+	JsonObject location = state["location"];
+	JsonObject tuning = state["tuning"];
 
-			if (doc["cmd"] == "calibrate")
+	// Validate everything before anything is changed
+	if (!connection.isNull() && !validateNetworkSettings(connection, error))
+	{
+		error.replace("auth:", "state: connection");
+		return false;
+	}
+	if (!calibration.isNull() && calibration["calibrateStatus"] == "true" && calibration["shadeLenght"].as<int>() <= 0)
+	{
+		error = "state: calibration needs positive shadeLenght";
+		return false;
+	}
+	if (!timers.isNull())
+	{
+		if (timers["timers"].size() > MAX_TIMERS || timers["shadeSunrise"].as<int>() < 0 || timers["shadeSunrise"].as<int>() > SHADE_MAX ||
+			timers["shadeSunset"].as<int>() < 0 || timers["shadeSunset"].as<int>() > SHADE_MAX)
+		{
+			error = "state: too many timers or bad sunrise/sunset shade";
+			return false;
+		}
+		for (JsonArray timer : timers["timers"].as<JsonArray>())
+			if (!validTimer(timer))
 			{
-				Serial.print("Request from client to calibrate shade lenght...\n");
-				moveState = MOVE_CALIBRATE;
-				calibrateStatus = "progress";
-				shadeDoc["calibrateStatus"] = calibrateStatus;
-				calibrateCnt = 0;
-
-				// Serialize JSON object to string and send to client
-				ws_len = serializeJson(shadeDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
+				error = "state: timer must be [id, hour, min, shade]";
+				return false;
 			}
+	}
+	if (!location.isNull() && (fabs(location["lat"].as<float>()) > 90 || fabs(location["lng"].as<float>()) > 180 ||
+							   location["tz"].as<int>() < -12 || location["tz"].as<int>() > 14))
+	{
+		error = "state: location needs lat -90..90, lng -180..180, tz -12..14";
+		return false;
+	}
+	if (!tuning.isNull() && !tuning["light"].isNull() && !validLight(tuning["light"]))
+	{
+		error = "state: bad light settings";
+		return false;
+	}
 
-			if (doc["cmd"] == "stop")
-			{
-				Serial.print("Request from client to stop motor...\n");
-				moveState = MOVE_STOP;
-				if (calibrateStatus == "progress")
-				{
-					calibrateStatus = "false";
-					shadeDoc["calibrateStatus"] = calibrateStatus;
-					writeJsonFile(SPIFFS, shadePath, shadeDoc);
-
-					// Serialize JSON object to string and send to client
-					ws_len = serializeJson(shadeDoc, ws_data);
-					ws.textAll(ws_data, ws_len);
-				}
-				if (calibrateStatus == "true")
-				{
-					// Set current position as target and save to file
-					targetPos = currentPos;
-					shade = (int)(100.0 * targetPos / shadeLenght);
-					shadeDoc["targetPos"] = targetPos;
-					shadeDoc["shade"] = shade;
-					writeJsonFile(SPIFFS, shadePath, shadeDoc);
-
-					// Serialize JSON object to string and send to client
-					ws_len = serializeJson(shadeDoc, ws_data);
-					ws.textAll(ws_data, ws_len);
-				}
-			}
+	// New timers document is built in a fresh pool: values replaced in place would stay in the old pool
+	bool timersChanged = !timers.isNull() || !tuning.isNull() || !location.isNull();
+	DynamicJsonDocument timersNew(timersDoc.capacity());
+	if (timersChanged)
+	{
+		const char *timerKeys[] = {"timers", "onSunrise", "onSunset", "shadeSunrise", "shadeSunset"};
+		for (JsonPair kv : timersDoc.as<JsonObject>())
+		{
+			String key = kv.key().c_str();
+			bool replaced = (!tuning.isNull() && key == "light") || (!location.isNull() && key == "location");
+			for (int i = 0; i < 5 && !timers.isNull(); i++)
+				replaced |= key == timerKeys[i];
+			if (!replaced)
+				timersNew[key] = kv.value();
+		}
+		if (!timers.isNull())
+		{
+			timersNew["timers"] = timers["timers"];
+			if (timersNew["timers"].isNull())
+				timersNew.createNestedArray("timers");
+			timersNew["onSunrise"] = timers["onSunrise"] | false;
+			timersNew["onSunset"] = timers["onSunset"] | false;
+			timersNew["shadeSunrise"] = timers["shadeSunrise"];
+			timersNew["shadeSunset"] = timers["shadeSunset"];
+		}
+		if (!tuning.isNull())
+			timersNew["light"] = tuning["light"];
+		if (!location.isNull())
+			timersNew["location"] = location;
+		if (timersNew.overflowed())
+		{
+			error = "state: timers, location and tuning do not fit " + String(timersDoc.capacity()) + " bytes";
+			return false;
+		}
+	}
 
-			if (doc["cmd"] == "setShade")
-			{
-				Serial.printf("Request from client to set manual shade position: %d...\n", doc["shade"].as<int>());
-				shade = doc["shade"];
+	// Apply
+	uint8_t changes = 0;
+	if (timersChanged)
+	{
+		// Document is swapped while main loop schedule is not reading it
+		xSemaphoreTake(timersMutex, portMAX_DELAY);
+		swapTimers(timersNew);
+		xSemaphoreGive(timersMutex);
+		changes |= STORE_TIMERS | SEND_TIMERS;
+	}
+	if (!tuning.isNull())
+		loadLightSettings();
+	if (!location.isNull())
+	{
+		loadLocation();
+		// New time zone and sunrise/sunset time from main loop
+		sstime.dataReady = false;
+		timeSyncFlag = init_flag;
+	}
+	if (!calibration.isNull())
+	{
+		// Position of this unit is unknown on the imported length, homing run to upper switch sets it.
+		// Status "home" is saved so the run also starts after reboot, e.g. when imported in access point mode
+		motion.clear();
+		shadeLenght = calibration["shadeLenght"] | 0;
+		if (calibration["calibrateStatus"] == "true")
+		{
+			calibrateStatus = "home";
+			moveState = MOVE_CALIBRATE;
+			moveSource = SRC_CALIBRATE;
+			calibrateCnt = 0;
+		}
+		else
+		{
+			calibrateStatus = "false";
+			moveState = MOVE_STOP;
+		}
+		clearRtcCheckpoint();
+		targetPos = 0;
+		shade = 0;
+		shadeDoc["shadeLenght"] = shadeLenght;
+		shadeDoc["calibrateStatus"] = calibrateStatus;
+		shadeDoc["targetPos"] = targetPos;
+		shadeDoc["shade"] = shade;
+		changes |= STORE_SHADE | SEND_SHADE;
+	}
+	if (!connection.isNull())
+	{
+		// Blob exported without secrets keeps current password of the same network
+		if (connection["pass"].isNull() && cs.ssid && connection["ssid"] == cs.ssid)
+			connection["pass"] = cs.pass ? cs.pass : "";
+		// Same path as auth command: reboot from access point, live apply with rollback in station mode
+		connection["cmd"] = "auth";
+		changes |= applyCommand(connection, nullptr);
+	}
+	commitChanges(changes, nullptr);
+	wakeLoop();
+	return true;
+}
 
-				// Serialize JSON object to string and send to client
-				shadeDoc["shade"] = shade;
-				ws_len = serializeJson(shadeDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-			}
+// Collect state blob upload, blob is checked and applied when complete
+void onStateBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+	if (index == 0 && total <= STATE_MAX_SIZE)
+		request->_tempObject = malloc(total);
+	if (request->_tempObject && index + len <= total)
+		memcpy((uint8_t *)request->_tempObject + index, data, len);
+}
 
-			if (doc["cmd"] == "addSunset")
+// Device state export and import:
+//   curl -o state.bin http://<device>/state[?sections=timers,location,tuning][&secrets=1]
+// WiFi password is exported only with secrets=1
+//   curl --data-binary @state.bin -H "Content-Type: application/octet-stream" http://<device>/state
+void addStateRoutes()
+{
+	server.on("/state", HTTP_GET, [](AsyncWebServerRequest *request)
+			  {
+				  uint8_t mask = 0xFF;
+				  if (request->hasParam("sections"))
+				  {
+					  String names = "," + request->getParam("sections")->value() + ",";
+					  mask = 0;
+					  for (uint8_t type = SEC_CONNECTION; type <= SEC_TUNING; type++)
+						  if (names.indexOf("," + String(stateSections[type]) + ",") >= 0)
+							  mask |= 1 << type;
+				  }
+				  bool secrets = request->hasParam("secrets") && request->getParam("secrets")->value() == "1";
+				  String error = "state: no memory for export";
+				  uint8_t *buf = (uint8_t *)malloc(STATE_MAX_SIZE);
+				  size_t len = buf ? exportState(buf, STATE_MAX_SIZE, mask, secrets, error) : 0;
+				  if (len == 0)
+				  {
+					  free(buf);
+					  Serial.println("State export failed: " + error);
+					  request->send(500, "text/plain", error);
+					  return;
+				  }
+				  AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+				  response->write(buf, len);
+				  free(buf);
+				  response->addHeader("Content-Disposition", "attachment; filename=state.bin");
+				  request->send(response); });
+	server.on(
+		"/state", HTTP_POST, [](AsyncWebServerRequest *request)
+		{
+			String error = "state: missing body or larger than " + String(STATE_MAX_SIZE) + " bytes";
+			if (request->_tempObject && importState((uint8_t *)request->_tempObject, request->contentLength(), error))
+				request->send(200, "text/plain", "OK");
+			else
 			{
-				Serial.printf("Request from client to set shade position: %d on sunset...\n", doc["shadeSunset"].as<int>());
-				onSunset = true;
-				timersDoc["onSunset"] = onSunset;
-				timersDoc["shadeSunset"] = doc["shadeSunset"];
-
-				serializeJson(timersDoc, Serial);
-				ws_len = serializeJson(timersDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-				Serial.println();
-				writeJsonFile(SPIFFS, timersPath, timersDoc);
-			}
+				Serial.println("State import rejected: " + error);
+				request->send(400, "text/plain", error);
+			} },
+		NULL, onStateBody);
+}
 
-			if (doc["cmd"] == "addSunrise")
-			{
-				Serial.printf("Request from client to set shade position: %d on sunrise...\n", doc["shadeSunrise"].as<int>());
-				onSunrise = true;
-				timersDoc["onSunrise"] = onSunrise;
-				timersDoc["shadeSunrise"] = doc["shadeSunrise"];
-
-				serializeJson(timersDoc, Serial);
-				ws_len = serializeJson(timersDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-				Serial.println();
-				writeJsonFile(SPIFFS, timersPath, timersDoc);
-			}
+// Send error message only to client which sent the command
+void sendCommandError(AsyncWebSocketClient *client, const String &error)
+{
+	Serial.println("Command rejected: " + error);
+	DynamicJsonDocument doc(256);
+	doc["error"] = error;
+	sendJson(doc, client);
+}
 
-			if (doc["cmd"] == "addTimer")
-			{
-				Serial.printf("Request from client to add new timer id: %s...\n", doc["timer"][0].as<String>());
+// Handle complete web socket message: one command object or an array of commands applied atomically
+void handleCommands(AsyncWebSocketClient *client, char *msg, size_t len)
+{
+	Serial.printf("WebSocket message received: %s\n", msg);
+
+	// Deserialize JSON object from string, strings are copied to the document
+	trace(TR_PARSE, traceCmd, 'B');
+	DynamicJsonDocument doc(len * 2 + 1024);
+	DeserializationError err = deserializeJson(doc, (const char *)msg, len);
+	trace(TR_PARSE, traceCmd, 'E');
+	if (err != DeserializationError::Ok)
+	{
+		Serial.println("Error parsing JSON");
+		return;
+	}
 
-				if (nTimers < 10)
-				{
-					timersArray.add(doc["timer"]);
-				}
+	BatchCheck batch;
+	beginBatchCheck(batch);
+	String error;
 
-				nTimers = timersArray.size();
-				Serial.printf("Number of timers: %d\n", nTimers);
-				serializeJson(timersDoc, Serial);
-				ws_len = serializeJson(timersDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-				Serial.println();
-				writeJsonFile(SPIFFS, timersPath, timersDoc);
-			}
+	// Single command
+	if (doc.is<JsonObject>())
+	{
+		trace(TR_APPLY, traceCmd, 'B');
+		if (!validateCommand(doc.as<JsonObject>(), batch, error))
+		{
+			trace(TR_APPLY, traceCmd, 'E');
+			sendCommandError(client, error);
+			return;
+		}
+		DynamicJsonDocument timersNew(batch.timersChanged ? timersDoc.capacity() : 0);
+		if (batch.timersChanged && !buildTimers(doc.as<JsonVariant>(), timersNew, error))
+		{
+			trace(TR_APPLY, traceCmd, 'E');
+			sendCommandError(client, error);
+			return;
+		}
+		xSemaphoreTake(timersMutex, portMAX_DELAY);
+		if (batch.timersChanged)
+			swapTimers(timersNew);
+		uint8_t changes = applyCommand(doc.as<JsonObject>(), client);
+		xSemaphoreGive(timersMutex);
+		trace(TR_APPLY, traceCmd, 'E');
+		commitChanges(changes, client);
+		return;
+	}
 
-			// If delete timer message received
-			if (doc["cmd"] == "deleteTimer")
-			{
-				Serial.printf("Request from client to remove timer id %s at %s ...\n", doc["id"].as<String>(), doc["time"].as<String>());
-				nTimers = timersArray.size();
+	// Batch of commands, validate all of them before applying any
+	trace(TR_APPLY, traceCmd, 'B');
+	JsonArray cmds = doc.as<JsonArray>();
+	for (JsonVariant cmd : cmds)
+	{
+		if (!cmd.is<JsonObject>() || !validateCommand(cmd.as<JsonObject>(), batch, error))
+		{
+			trace(TR_APPLY, traceCmd, 'E');
+			sendCommandError(client, "batch rejected, " + (error.length() ? error : String("command is not an object")));
+			return;
+		}
+	}
 
-				// Find and remove timer from array by id
-				for (int i = 0; i < nTimers; i++)
-				{
-					if (timersArray[i][0].as<String>() == doc["id"].as<String>())
-					{
-						timersArray.remove(i);
-						Serial.printf("Timer %d id %s removed\n", i, doc["id"].as<String>());
-					}
-				}
+	// Timers after the whole batch must fit before any command is applied
+	DynamicJsonDocument timersNew(batch.timersChanged ? timersDoc.capacity() : 0);
+	if (batch.timersChanged && !buildTimers(doc.as<JsonVariant>(), timersNew, error))
+	{
+		trace(TR_APPLY, traceCmd, 'E');
+		sendCommandError(client, "batch rejected, " + error);
+		return;
+	}
 
-				if (doc["time"] == "Восход")
-				{
-					onSunrise = false;
-					timersDoc["onSunrise"] = onSunrise;
-				}
+	uint8_t changes = 0;
+	xSemaphoreTake(timersMutex, portMAX_DELAY);
+	if (batch.timersChanged)
+		swapTimers(timersNew);
+	for (JsonVariant cmd : cmds)
+		changes |= applyCommand(cmd.as<JsonObject>(), client);
+	xSemaphoreGive(timersMutex);
+	trace(TR_APPLY, traceCmd, 'E');
+	Serial.printf("Batch of %u commands applied\n", cmds.size());
+	commitChanges(changes, client);
+}
 
-				if (doc["time"] == "Закат")
-				{
-					onSunset = false;
-					timersDoc["onSunset"] = onSunset;
-				}
+// Handle web socket message WS_EVT_DATA, messages split into several packets are reassembled
+void handleWebSocketMessage(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len)
+{
+	AwsFrameInfo *info = (AwsFrameInfo *)arg;
+	if (info->opcode != WS_TEXT || !info->final || info->num != 0)
+		return;
+	if (info->index == 0)
+		trace(TR_WS_RX, ++traceCmd, 'i');
 
-				nTimers = timersArray.size();
-				Serial.printf("Number of timers: %d\n", nTimers);
-				serializeJson(timersDoc, Serial);
-				ws_len = serializeJson(timersDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-				Serial.println();
-				writeJsonFile(SPIFFS, timersPath, timersDoc);
-			}
-			// If get timers message received
-			if (doc["cmd"] == "getTimers")
-			{
-				Serial.printf("Request from client number of timers...\n");
-				nTimers = timersArray.size();
-				Serial.printf("Number of timers: %d\n", nTimers);
-				serializeJson(timersDoc, Serial);
-				ws_len = serializeJson(timersDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
-			}
+	if (info->index == 0 && info->len == len)
+	{
+		data[len] = 0;
+		handleCommands(client, (char *)data, len);
+	}
+	else
+	{
+		char *buf = (char *)client->_tempObject;
+		if (info->index == 0)
+		{
+			free(buf);
+			buf = info->len <= WS_MAX_MESSAGE ? (char *)malloc(info->len + 1) : nullptr;
+			client->_tempObject = buf;
+			if (!buf)
+				Serial.printf("WebSocket message of %llu bytes dropped\n", info->len);
 		}
-		else
+		if (!buf)
+			return;
+		memcpy(buf + info->index, data, len);
+		if (info->index + len == info->len)
 		{
-			Serial.println("Error parsing JSON");
+			buf[info->len] = 0;
+			handleCommands(client, buf, info->len);
+			free(buf);
+			client->_tempObject = nullptr;
 		}
-
-		clientRequest = true;
 	}
+	clientRequest = true;
+	wakeLoop();
 }
 
 // Web socket onEvent handler
@@ -418,24 +2256,23 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType
 	case WS_EVT_CONNECT:
 		Serial.printf("Client [%u] is connected %s\n", client->id(), client->remoteIP().toString());
 
-		// Serialize object to JSON string and send to client
+		// Send cached state snapshots only to connected client
 		if (cs.ssid == 0)
 		{
-			ws_len = serializeJson(networksDoc, ws_data);
-			ws.textAll(ws_data, ws_len);
+			sendSnapshot(networksSnapshot, client);
 		}
 		else
 		{
-			ws_len = serializeJson(shadeDoc, ws_data);
-			ws.textAll(ws_data, ws_len);
-			ws_len = serializeJson(timersDoc, ws_data);
-			ws.textAll(ws_data, ws_len);
+			sendSnapshot(shadeSnapshot, client);
+			sendSnapshot(timersSnapshot, client);
 		}
 		break;
 
 	// Client disconnected from server
 	case WS_EVT_DISCONNECT:
 		Serial.printf("Client [%u] disconnected\n", client->id());
+		free(client->_tempObject);
+		client->_tempObject = nullptr;
 		break;
 
 	// Error occured
@@ -445,7 +2282,7 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType
 
 	// Message received from client
 	case WS_EVT_DATA:
-		handleWebSocketMessage(arg, data, len);
+		handleWebSocketMessage(client, arg, data, len);
 		break;
 	default:
 		break;
@@ -474,6 +2311,18 @@ void IRAM_ATTR onTimer()
 		localHour = 0;
 		timeSyncFlag = true;
 	}
+
+	// Wake main loop only when a schedule event may be due: clock timers fire at zero seconds
+	if (localSec == 0 || timeSyncFlag ||
+		(localHour == sstime.sunriseHour && localMin == sstime.sunriseMin && localSec == sstime.sunriseSec) ||
+		(localHour == sstime.sunsetHour && localMin == sstime.sunsetMin && localSec == sstime.sunsetSec))
+		wakeLoopFromISR();
+}
+
+// Upper limit switch interrupt
+void IRAM_ATTR onSwitch()
+{
+	wakeLoopFromISR();
 }
 
 // GET request from sunrise-sunset API
@@ -546,25 +2395,29 @@ JsonArray scanNetworks()
 // Setup
 void setup()
 {
-	pinMode(SM_STEP, OUTPUT);
-	pinMode(SM_DIR, OUTPUT);
-	pinMode(SM_nEN, OUTPUT);
-	pinMode(SW, INPUT_PULLUP);
-	pinMode(LED_CONNECT, OUTPUT);
-	pinMode(23, INPUT);
+	loopTask = xTaskGetCurrentTaskHandle();
+	wsMutex = xSemaphoreCreateMutex();
+	timersMutex = xSemaphoreCreateMutex();
 
-	digitalWrite(SM_DIR, HIGH);
+	pinMode(Hw::stepPin, OUTPUT);
+	pinMode(Hw::dirPin, OUTPUT);
+	pinMode(Hw::nEnPin, OUTPUT);
+	pinMode(Hw::switchPin, Hw::switchActiveLow ? INPUT_PULLUP : INPUT_PULLDOWN);
+	pinMode(Hw::ledPin, OUTPUT);
+	attachInterrupt(Hw::switchPin, onSwitch, Hw::switchActiveLow ? FALLING : RISING);
+
+	Hw::direction(true);
 
 	// Disable motor
-	digitalWrite(SM_nEN, HIGH);
+	Hw::enable(false);
 
 	Serial.begin(115200);
 
-	// Init SPIFFS
-	initSPIFFS();
+	// Init file storage
+	initStorage();
 
 	// Read connection settings file
-	csDoc = readJsonFile(SPIFFS, csPath);
+	csDoc = readJsonFile(storage, csPath);
 	Serial.println("Read connection settings file...");
 	Serial.println("File content: ");
 	serializeJson(csDoc, Serial);
@@ -589,7 +2442,7 @@ void setup()
 	}
 
 	// Read shade settings file
-	shadeDoc = readJsonFile(SPIFFS, shadePath);
+	shadeDoc = readJsonFile(storage, shadePath);
 	Serial.println("Read shade settings file...");
 	Serial.println("File content: ");
 	serializeJson(shadeDoc, Serial);
@@ -601,7 +2454,33 @@ void setup()
 		shade = shadeDoc["shade"];
 		calibrateStatus = shadeDoc["calibrateStatus"].as<String>();
 		moveState = MOVE_STOP;
-		currentPos = targetPos;
+		// Homing run after state import is not finished
+		if (calibrateStatus == "home")
+		{
+			moveState = MOVE_CALIBRATE;
+			moveSource = SRC_CALIBRATE;
+		}
+
+		// Restore position from the freshest valid checkpoint: RTC memory, flash or last target
+		currentPos = shadeDoc["currentPos"] | targetPos;
+		checkpointSeq = shadeDoc["seq"] | 0;
+		PositionCheckpoint moving;
+		if (calibrateStatus == "true" && readMovingCheckpoint(moving) && moving.seq > checkpointSeq)
+		{
+			currentPos = moving.currentPos;
+			shade = moving.shade;
+			checkpointSeq = moving.seq;
+		}
+		if (calibrateStatus == "true" && rtcCheckpointValid() && rtcCheckpoint.seq >= checkpointSeq)
+		{
+			currentPos = rtcCheckpoint.currentPos;
+			shade = rtcCheckpoint.shade;
+			checkpointSeq = rtcCheckpoint.seq;
+			Serial.println("Position restored from RTC checkpoint");
+		}
+		else
+			Serial.println("Position restored from flash checkpoint");
+		shadeDoc["shade"] = shade;
 
 		Serial.println("Shade lenght: " + String(shadeLenght));
 		Serial.println("Current position: " + String(currentPos));
@@ -628,12 +2507,12 @@ void setup()
 		shadeDoc["shade"] = shade;
 		shadeDoc["calibrateStatus"] = calibrateStatus;
 
-		writeJsonFile(SPIFFS, shadePath, shadeDoc);
+		writeJsonFile(storage, shadePath, shadeDoc);
 	}
 
-	// Read saving timers from SPIFFS and add to current timers array
-	DynamicJsonDocument doc(1024);
-	doc = readJsonFile(SPIFFS, timersPath);
+	// Read saving timers from storage and add to current timers array
+	DynamicJsonDocument doc(4096);
+	doc = readJsonFile(storage, timersPath, 4096);
 	if (doc != nullptr)
 	{
 		Serial.println("Saving timers doc:");
@@ -652,12 +2531,19 @@ void setup()
 		timersDoc["onSunset"] = doc["onSunset"];
 		timersDoc["shadeSunrise"] = doc["shadeSunrise"];
 		timersDoc["shadeSunset"] = doc["shadeSunset"];
+		timersDoc["light"] = doc["light"];
+		timersDoc["location"] = doc["location"];
+		loadLightSettings();
+		loadLocation();
 	}
 	else
 	{
 		Serial.println("Error reading timers file");
 	}
 
+	// Open movement history
+	initHistory();
+
 	// If ssid is empty create access point
 	if (cs.ssid == 0)
 	{
@@ -681,9 +2567,11 @@ void setup()
 
 		// Route WiFi settings page
 		server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-				  { request->send(SPIFFS, "/wifiinit.html"); });
+				  { sendPage(request, "/wifiinit.html"); });
+		addStateRoutes();
+		addOtaRoutes();
 
-		server.serveStatic("/", SPIFFS, "/");
+		server.serveStatic("/", storage, "/");
 		server.begin();
 	}
 
@@ -693,6 +2581,7 @@ void setup()
 		init_flag = true;
 
 		WiFi.mode(WIFI_STA);
+		WiFi.onEvent(onWiFiDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
 		localIP.fromString(cs.ip);
 		localDNS.fromString(cs.dns);
 		localGateway.fromString(cs.gateway);
@@ -717,9 +2606,9 @@ void setup()
 			while (WiFi.status() != WL_CONNECTED)
 			{
 				Serial.print('.');
-				digitalWrite(LED_CONNECT, HIGH);
+				Hw::led(true);
 				delay(200);
-				digitalWrite(LED_CONNECT, LOW);
+				Hw::led(false);
 				delay(200);
 
 				currMillis = millis();
@@ -730,7 +2619,7 @@ void setup()
 					ESP.restart();
 				}
 			}
-			digitalWrite(LED_CONNECT, HIGH);
+			Hw::led(true);
 
 			Serial.println(" -success");
 			Serial.printf("Connected to WiFi: %s", String(cs.ssid));
@@ -738,6 +2627,13 @@ void setup()
 			Serial.print("Local IP: ");
 			Serial.println(WiFi.localIP());
 
+			// Name for clients after network settings change, follows address changes by itself
+			if (MDNS.begin(MDNS_NAME))
+			{
+				MDNS.addService("http", "tcp", 80);
+				Serial.println("mDNS host: " MDNS_NAME ".local");
+			}
+
 			// Try to get local time with timeout 10 sec
 			Serial.print("Waiting for NTP time sync... ");
 			configTime(tz * 3600, 0, "pool.ntp.org", "time.nist.gov");
@@ -772,14 +2668,39 @@ void setup()
 			// Start timer
 			timerAlarmEnable(timer);
 
+			// Start ambient light sampling
+			initLightSensor();
+
 			// Connect AsyncWebSocket
 			ws.onEvent(onEvent);
 			server.addHandler(&ws);
 
-			// Route to main page index.html on SPIFFS
+			// Route to main page index.html on storage
 			server.on("/", HTTP_ANY, [](AsyncWebServerRequest *request)
-					  { request->send(SPIFFS, "/index.html"); });
-			server.serveStatic("/", SPIFFS, "/");
+					  { sendPage(request, "/index.html"); });
+
+			// Command trace in Chrome trace-event format, open in chrome://tracing or Perfetto
+			server.on("/trace.json", HTTP_GET, [](AsyncWebServerRequest *request)
+					  {
+						  std::shared_ptr<TraceExport> exp = std::make_shared<TraceExport>();
+						  AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [exp](uint8_t *buffer, size_t maxLen, size_t index)
+																						   { return exp->fill(buffer, maxLen); });
+						  response->addHeader("Content-Disposition", "attachment; filename=trace.json");
+						  request->send(response); });
+
+			// Movement history page: /history?from=<epoch>&to=<epoch>&page=<n>
+			server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request)
+					  {
+						  DynamicJsonDocument doc(3072);
+						  historyToJson(doc,
+										request->hasParam("from") ? request->getParam("from")->value().toInt() : 0,
+										request->hasParam("to") ? request->getParam("to")->value().toInt() : 0xFFFFFFFF,
+										request->hasParam("page") ? request->getParam("page")->value().toInt() : 0);
+						  AsyncResponseStream *response = request->beginResponseStream("application/json");
+						  serializeJson(doc, *response);
+						  request->send(response); });
+			addStateRoutes();
+			server.serveStatic("/", storage, "/");
 
 			// Try to get sunrise/sunset time with timeout 10 sec
 			Serial.print("Request to Sunrise-Sunset API...");
@@ -787,7 +2708,7 @@ void setup()
 			prevMillis = currMillis;
 			while (!sstime.dataReady)
 			{
-				sstime = getSunriseSunset("https://api.sunrise-sunset.org/json?lat=54.93583&lng=43.32352&date=today", tz);
+				sstime = getSunriseSunset(sunriseUrl(), tz);
 				Serial.print(".");
 
 				currMillis = millis();
@@ -802,16 +2723,10 @@ void setup()
 			Serial.println("Sunset: " + sstime.strSunset24);
 			shadeDoc["sunrise"] = sstime.strSunrise24;
 			shadeDoc["sunset"] = sstime.strSunset24;
-			ws_len = serializeJson(shadeDoc, ws_data);
-			ws.textAll(ws_data, ws_len);
+			sendSnapshotAll(shadeSnapshot);
 		}
 
-		// Start ElegantOTA server for on air updates
-		ElegantOTA.begin(&server); // Start ElegantOTA
-		// ElegantOTA callbacks
-		ElegantOTA.onStart(onOTAStart);
-		ElegantOTA.onProgress(onOTAProgress);
-		ElegantOTA.onEnd(onOTAEnd);
+		addOtaRoutes();
 		// Start server
 		server.begin();
 		Serial.println("HTTP server started...");
@@ -822,23 +2737,37 @@ void setup()
 void loop()
 {
 	ElegantOTA.loop();
+	// Reboot after compressed OTA update or initial WiFi setup when response is sent
+	if (reboot_millis && millis() - reboot_millis > 2000)
+	{
+		Serial.println("ESP rebooting...");
+		ESP.restart();
+	}
 	// If the system is not initialized, blink briefly 2 times
 	if (!init_flag)
 	{
-		digitalWrite(LED_CONNECT, HIGH);
+		Hw::led(true);
 		delay(70);
-		digitalWrite(LED_CONNECT, LOW);
+		Hw::led(false);
 		delay(70);
-		digitalWrite(LED_CONNECT, HIGH);
+		Hw::led(true);
 		delay(70);
-		digitalWrite(LED_CONNECT, LOW);
+		Hw::led(false);
 		delay(500);
 	}
 
 	// If the system is initialized, turn on the LED
 	else
 	{
-		digitalWrite(LED_CONNECT, HIGH);
+		Hw::led(true);
+
+		// New shade target from client command
+		if (motionCmd != pickedCmd)
+		{
+			pickedCmd = motionCmd;
+			moveCmd = pickedCmd;
+			trace(TR_LOOP_PICKUP, pickedCmd, 'i');
+		}
 
 		// Sync local time and get new sunrise/sunset time every day at 24:00:00
 		if (timeSyncFlag)
@@ -876,7 +2805,7 @@ void loop()
 			prevMillis = currMillis;
 			while (!sstime.dataReady)
 			{
-				sstime = getSunriseSunset("https://api.sunrise-sunset.org/json?lat=54.93583&lng=43.32352&date=today", tz);
+				sstime = getSunriseSunset(sunriseUrl(), tz);
 				Serial.print(".");
 
 				currMillis = millis();
@@ -891,37 +2820,46 @@ void loop()
 			Serial.println("Sunset: " + sstime.strSunset12);
 			shadeDoc["sunrise"] = sstime.strSunrise24;
 			shadeDoc["sunset"] = sstime.strSunset24;
-			ws_len = serializeJson(shadeDoc, ws_data);
-			ws.textAll(ws_data, ws_len);
+			sendSnapshotAll(shadeSnapshot);
 		}
 
 		// Check upper switch limit status
-		sw_flag = !digitalRead(SW);
+		sw_flag = Hw::switchPressed();
 		// if upper switch limit trggered in calibrate mode save target position as shade lenght
 		if (sw_flag && moveState == MOVE_CALIBRATE)
 		{
 			moveState = MOVE_STOP;
-			shadeLenght = calibrateCnt;
+			// Homing run after state import keeps imported shade length
+			bool homing = calibrateStatus == "home";
+			if (!homing)
+				shadeLenght = calibrateCnt;
 			currentPos = 0;
 			targetPos = currentPos;
-			shade = (int)(100.0 * targetPos / shadeLenght);
-			if (calibrateStatus == "progress")
+			shade = posToShade(targetPos, shadeLenght);
+			if (calibrateStatus == "progress" || homing)
 			{
 				calibrateStatus = "true";
+				if (homing)
+					Serial.printf("Homed after %d steps\n", calibrateCnt);
+				else
+					Serial.printf("Calibrated: %d steps, %d mm\n", shadeLenght, (int)(shadeLenght / Hw::stepsPerMm));
 				// Save calibrate status
 				shadeDoc["shadeLenght"] = shadeLenght;
 				shadeDoc["calibrateStatus"] = "true";
 				shadeDoc["targetPos"] = currentPos;
 				shadeDoc["shade"] = shade;
-				writeJsonFile(SPIFFS, shadePath, shadeDoc);
-				ws_len = serializeJson(shadeDoc, ws_data);
-				ws.textAll(ws_data, ws_len);
+				saveRtcCheckpoint();
+				saveFlashCheckpoint();
+				sendSnapshotAll(shadeSnapshot);
 			}
 		}
 
 		if (calibrateStatus == "true")
 		{
-			targetPos = (int)(shadeLenght * shade / 100.0);
+			// Next waypoint from motion queue
+			serviceMotionQueue();
+
+			targetPos = shadeToPos(shade, shadeLenght);
 			if (currentPos < targetPos)
 			{
 				moveState = MOVE_DOWN;
@@ -936,85 +2874,154 @@ void loop()
 			if (currentPos == targetPos)
 			{
 				moveState = MOVE_STOP;
+				// Command needed no motion, do not report latency on a later unrelated move
+				commandMicros = 0;
 				if (!targetFlag)
 				{
 					shadeDoc["targetPos"] = targetPos;
 					shadeDoc["shade"] = shade;
-					writeJsonFile(SPIFFS, shadePath, shadeDoc);
-
-					// Serialize JSON object to string and send to client
-					ws_len = serializeJson(shadeDoc, ws_data);
-					ws.textAll(ws_data, ws_len);
+					trace(TR_PERSIST, moveCmd, 'B');
+					saveFlashCheckpoint();
+					trace(TR_PERSIST, moveCmd, 'E');
+
+					// Serialize JSON object and send to all clients
+					trace(TR_BROADCAST, moveCmd, 'B');
+					sendSnapshotAll(shadeSnapshot);
+					trace(TR_BROADCAST, moveCmd, 'E');
 				}
 				targetFlag = true;
 			}
 		}
 
+		// Track movement for history
+		trackMove();
+
 		if (moveState == MOVE_DOWN)
 		{
 			// Enable motor and move down
-			digitalWrite(SM_nEN, LOW);
-			digitalWrite(SM_DIR, HIGH);
+			Hw::enable(true);
+			Hw::direction(true);
 			currentPos++;
+			saveRtcCheckpoint();
 		}
 		if (moveState == MOVE_UP)
 		{
 			// Enable motor and move up
-			digitalWrite(SM_nEN, LOW);
-			digitalWrite(SM_DIR, LOW);
+			Hw::enable(true);
+			Hw::direction(false);
 			currentPos--;
+			saveRtcCheckpoint();
 		}
 		if (moveState == MOVE_CALIBRATE)
 		{
 			// Enable motor and move up
-			digitalWrite(SM_nEN, LOW);
-			digitalWrite(SM_DIR, LOW);
+			Hw::enable(true);
+			Hw::direction(false);
 			calibrateCnt++;
 		}
 		if (moveState == MOVE_STOP)
 		{
 			// Disable motor
-			digitalWrite(SM_nEN, HIGH);
+			Hw::enable(false);
+			motion.stop();
+		}
+
+		// Low-frequency flash checkpoint of position while moving for power loss. Stepping pauses
+		// for the write, so the ramp starts again from minimum speed
+		if ((moveState == MOVE_UP || moveState == MOVE_DOWN) && millis() - checkpointMillis >= CHECKPOINT_FLASH_PERIOD)
+		{
+			saveMovingCheckpoint();
+			motion.stop();
 		}
 
-		// Generate STEP-signal for step motor
-		digitalWrite(SM_STEP, HIGH);
-		delayMicroseconds(1000);
-		digitalWrite(SM_STEP, LOW);
-		delayMicroseconds(1000);
+		// Generate STEP-signal for step motor, no pulses while stopped
+		if (moveState != MOVE_STOP)
+		{
+			if (commandMicros)
+			{
+				Serial.printf("Command to motion latency: %lu us\n", micros() - commandMicros);
+				commandMicros = 0;
+				trace(TR_MOTOR_START, moveCmd, 'i');
+			}
+			unsigned int halfPeriod = motion.rampHalfPeriod(currentPos, targetPos, shadeLenght, moveDirection(), moveState != MOVE_CALIBRATE);
+			Hw::step(true);
+			delayMicroseconds(halfPeriod);
+			Hw::step(false);
+			delayMicroseconds(halfPeriod);
+		}
 
 		//  Send data to client every second by timer
 		if (timerInt)
 		{
+			xSemaphoreTake(timersMutex, portMAX_DELAY);
 			// Serial.println("Current local time: " + (String)localHour + ":" + (String)localMin + ":" + (String)localSec);
 			for (int i = 0; i < nTimers; i++)
 			{
 				if (localHour == timersDoc["timers"][i][1].as<int>() && localMin == timersDoc["timers"][i][2].as<int>() && localSec == 0)
 				{
-					shade = timersDoc["timers"][i][3].as<int>();
+					setShadeTarget(timersDoc["timers"][i][3].as<int>(), SRC_TIMER);
 					Serial.printf("Set shade to: %d at %d:%d\n", shade, localHour, localMin);
 				}
 			}
 			if (onSunrise)
 				if (localHour == sstime.sunriseHour && localMin == sstime.sunriseMin && localSec == sstime.sunriseSec)
 				{
-					shade = timersDoc["shadeSunrise"].as<int>();
+					setShadeTarget(timersDoc["shadeSunrise"].as<int>(), SRC_SUNRISE);
 					Serial.printf("Set shade to: %d at %d:%d:%d on sunrise\n", shade, localHour, localMin, localSec);
 				}
 			if (onSunset)
 				if (localHour == sstime.sunsetHour && localMin == sstime.sunsetMin && localSec == sstime.sunsetSec)
 				{
-					shade = timersDoc["shadeSunset"].as<int>();
+					setShadeTarget(timersDoc["shadeSunset"].as<int>(), SRC_SUNSET);
 					Serial.printf("Set shade to: %d at %d:%d:%d on sunset\n", shade, localHour, localMin, localSec);
 				};
+			xSemaphoreGive(timersMutex);
 			timerInt = false;
 		}
+
+		// Ambient light target posted by light task
+		if (lightShade >= 0)
+		{
+			setShadeTarget(lightShade, SRC_LIGHT);
+			lightShade = -1;
+			Serial.printf("Set shade to: %d on ambient light\n", shade);
+		}
 		// Request from client processing
 		if (clientRequest)
 		{
 			clientRequest = false;
 		}
 
+		xSemaphoreTake(wsMutex, portMAX_DELAY);
 		ws.cleanupClients();
+		xSemaphoreGive(wsMutex);
+
+		// Apply network settings changed by client
+		if (netState != NET_IDLE)
+			serviceNetwork();
+
+		// Write movement history only while motor is stopped and no queued waypoint is waiting
+		if (moveState == MOVE_STOP && !motion.pending())
+			flushHistory();
+
+		// Block until command, schedule event or limit switch while motor is stopped, CPU idles meanwhile
+		if (moveState == MOVE_STOP && !timeSyncFlag && !motion.pending())
+		{
+			unsigned long idleStart = micros();
+			long timeout = netState != NET_IDLE ? NET_POLL_PERIOD : IDLE_WAKE_PERIOD;
+			long dwell = motion.dwellLeft(millis());
+			if (dwell >= 0)
+				timeout = min(dwell, timeout);
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeout));
+			idleMicros += micros() - idleStart;
+		}
+
+		// Loop load statistics
+		if (millis() - statsMillis >= STATS_PERIOD)
+		{
+			Serial.printf("Loop busy: %lu%%\n", 100 - idleMicros / 10 / (millis() - statsMillis));
+			idleMicros = 0;
+			statsMillis = millis();
+		}
 	}
 }
\ No newline at end of file
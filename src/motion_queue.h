@@ -0,0 +1,202 @@
+// Bounded waypoint queue with look-ahead blending and acceleration ramp. Time, positions and
+// direction are passed in by the motor loop, so host tests can drive it with a simulated stepper
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include "hardware.h"
+
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#define MOTION_LOCK() portENTER_CRITICAL(&_mux)
+#define MOTION_UNLOCK() portEXIT_CRITICAL(&_mux)
+#else
+#define MOTION_LOCK()
+#define MOTION_UNLOCK()
+#endif
+
+#define MOTION_QUEUE_SIZE 8
+
+// Motion queue waypoint
+struct Waypoint
+{
+	uint8_t shade;	// Target, percent
+	uint16_t dwell; // Wait at waypoint, seconds
+	uint16_t speed; // Steps per second, 0 - default
+};
+
+// Commands add and clear waypoints from network task, motor loop services the queue.
+// Direction: 1 - down (position grows), -1 - up, 0 - stopped
+template <class Motor>
+class MotionQueue
+{
+public:
+	// Add waypoint to queue tail
+	bool enqueue(const Waypoint &wp)
+	{
+		bool added = false;
+		MOTION_LOCK();
+		if (_count < MOTION_QUEUE_SIZE)
+		{
+			_queue[(_head + _count) % MOTION_QUEUE_SIZE] = wp;
+			_count++;
+			added = true;
+		}
+		MOTION_UNLOCK();
+		return added;
+	}
+
+	// Drop queued waypoints, direct shade targets replace the queue
+	void clear()
+	{
+		MOTION_LOCK();
+		_count = 0;
+		_active = false;
+		_dwelling = false;
+		_halfPeriod = Motor::halfPeriod;
+		MOTION_UNLOCK();
+	}
+
+	// Queued waypoints, active one not included
+	int count() const { return _count; }
+	int free() const { return MOTION_QUEUE_SIZE - _count; }
+
+	// Motor loop has queued work even with motor stopped
+	bool pending() const { return _count > 0 && !_dwelling; }
+
+	// Time left at current waypoint, -1 if not dwelling
+	long dwellLeft(unsigned long ms) const
+	{
+		if (!_dwelling)
+			return -1;
+		long left = (long)(_dwellUntil - ms);
+		return left > 0 ? left : 0;
+	}
+
+	// Waypoint the motor is moving to and queued ones, out needs MOTION_QUEUE_SIZE + 1 entries
+	int copy(Waypoint *out)
+	{
+		MOTION_LOCK();
+		int n = 0;
+		if (_active)
+			out[n++] = _current;
+		for (int i = 0; i < _count; i++)
+			out[n++] = _queue[(_head + i) % MOTION_QUEUE_SIZE];
+		MOTION_UNLOCK();
+		return n;
+	}
+
+	// Take next waypoint when current target is reached. With look-ahead the motor passes through
+	// a waypoint without stopping when next one continues in the same direction and there is no dwell.
+	// Returns true with the new target in next and shade. Runs locked and sets shade under the lock, so a
+	// command that calls clear() before writing its own shade always wins over a waypoint
+	bool service(unsigned long ms, int currentPos, int &shade, int length, int direction, Waypoint &next, bool &blended)
+	{
+		MOTION_LOCK();
+		bool taken = take(ms, currentPos, shade, length, direction, next, blended);
+		MOTION_UNLOCK();
+		return taken;
+	}
+
+	// Step half period on acceleration ramp toward cruise speed of current waypoint. Braking distance
+	// includes next queued waypoint when the motor blends through current target, no braking while calibrating
+	unsigned int rampHalfPeriod(int currentPos, int targetPos, int length, int direction, bool brake)
+	{
+		if (!Motor::accel)
+			return _halfPeriod;
+		float cruise = 500000.0f / _halfPeriod;
+		long remaining = abs(targetPos - currentPos);
+		Waypoint next;
+		if (_active && !_current.dwell && peek(next))
+		{
+			int nextPos = shadeToPos(next.shade, length);
+			if ((direction > 0 && nextPos > targetPos) || (direction < 0 && nextPos < targetPos))
+				remaining += abs(nextPos - targetPos);
+		}
+		if (_rate < Motor::minSpeed)
+			_rate = Motor::minSpeed;
+		else if (brake && _rate * _rate >= 2.0f * Motor::accel * remaining)
+			_rate -= Motor::accel / _rate;
+		else if (_rate < cruise)
+			_rate = cruise < _rate + Motor::accel / _rate ? cruise : _rate + Motor::accel / _rate;
+		else
+			_rate = cruise > _rate - Motor::accel / _rate ? cruise : _rate - Motor::accel / _rate;
+		if (_rate < Motor::minSpeed)
+			_rate = Motor::minSpeed;
+		return (unsigned int)(500000.0f / _rate);
+	}
+
+	// Motor stopped, next move starts from minimum speed
+	void stop() { _rate = 0; }
+
+	// Current step rate on acceleration ramp, steps/s
+	float rate() const { return _rate; }
+
+private:
+	// Look at next waypoint without removing it
+	bool peek(Waypoint &wp)
+	{
+		MOTION_LOCK();
+		bool found = _count > 0;
+		if (found)
+			wp = _queue[_head];
+		MOTION_UNLOCK();
+		return found;
+	}
+
+	// Body of service(), caller holds the lock
+	bool take(unsigned long ms, int currentPos, int &shade, int length, int direction, Waypoint &next, bool &blended)
+	{
+		if (_dwelling)
+		{
+			if ((long)(ms - _dwellUntil) < 0)
+				return false;
+			_dwelling = false;
+		}
+		if (currentPos != shadeToPos(shade, length))
+			return false;
+
+		if (_active)
+		{
+			_active = false;
+			if (_current.dwell)
+			{
+				_dwelling = true;
+				_dwellUntil = ms + _current.dwell * 1000UL;
+				return false;
+			}
+		}
+
+		if (_count == 0)
+		{
+			_halfPeriod = Motor::halfPeriod;
+			return false;
+		}
+		next = _queue[_head];
+		int nextPos = shadeToPos(next.shade, length);
+		blended = (direction > 0 && nextPos > currentPos) || (direction < 0 && nextPos < currentPos);
+		// Direction changes: stop and save position first
+		if (!blended && direction != 0)
+			return false;
+
+		_head = (_head + 1) % MOTION_QUEUE_SIZE;
+		_count--;
+		_current = next;
+		_active = true;
+		shade = next.shade;
+		_halfPeriod = next.speed ? 500000 / next.speed : Motor::halfPeriod;
+		return true;
+	}
+
+	Waypoint _queue[MOTION_QUEUE_SIZE];
+	int _head = 0;
+	volatile int _count = 0;
+	Waypoint _current; // Waypoint the motor is moving to
+	bool _active = false;
+	bool _dwelling = false;
+	unsigned long _dwellUntil = 0;
+	unsigned int _halfPeriod = Motor::halfPeriod;
+	float _rate = 0;
+#ifdef ARDUINO
+	portMUX_TYPE _mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+};
@@ -0,0 +1,80 @@
+// SHA-256 check of inflated OTA image, host tests get mbedtls/ headers from test/host
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "mbedtls/sha256.h"
+#include "gzip_stream.h"
+
+// Hashes data on its way to the next writer, image is accepted only when hash matches expected one
+class Sha256Writer
+{
+public:
+	// Expected hash is 64 hex digits of uncompressed image
+	bool begin(GzipStream::Writer next, const char *expected)
+	{
+		_next = next;
+		_error = nullptr;
+		_started = false;
+		if (!expected || strlen(expected) != 64)
+			return fail("sha256 of uncompressed image is required");
+		for (int i = 0; i < 64; i++)
+			_expected[i] = tolower((unsigned char)expected[i]);
+		_expected[64] = 0;
+		mbedtls_sha256_init(&_ctx);
+		mbedtls_sha256_starts_ret(&_ctx, 0);
+		_started = true;
+		return true;
+	}
+
+	// Writer for GzipStream: hash chunk, then pass it on
+	GzipStream::Writer writer()
+	{
+		return [this](const uint8_t *buf, size_t len)
+		{
+			mbedtls_sha256_update_ret(&_ctx, buf, len);
+			return _next(buf, len);
+		};
+	}
+
+	// Finish hash and compare, call once after last chunk
+	bool verify()
+	{
+		if (!_started)
+			return fail(_error ? _error : "not started");
+		uint8_t hash[32];
+		char hex[65];
+		mbedtls_sha256_finish_ret(&_ctx, hash);
+		mbedtls_sha256_free(&_ctx);
+		_started = false;
+		for (int i = 0; i < 32; i++)
+			sprintf(hex + i * 2, "%02x", hash[i]);
+		if (strcmp(hex, _expected) != 0)
+			return fail("sha256 mismatch");
+		return true;
+	}
+
+	// Drop hash state when upload fails before verify
+	void end()
+	{
+		if (_started)
+			mbedtls_sha256_free(&_ctx);
+		_started = false;
+	}
+
+	const char *error() { return _error; }
+
+private:
+	GzipStream::Writer _next;
+	mbedtls_sha256_context _ctx;
+	char _expected[65];
+	bool _started = false;
+	const char *_error = nullptr;
+
+	bool fail(const char *error)
+	{
+		_error = error;
+		return false;
+	}
+};
@@ -0,0 +1,14 @@
+// Web socket JSON messages, socket is a template parameter so host tests can count buffer writes
+#pragma once
+#include <ArduinoJson.h>
+
+// Serialize document straight into web socket message buffer, length is measured first
+template <class Socket>
+auto jsonBuffer(Socket &socket, const JsonDocument &doc) -> decltype(socket.makeBuffer(0))
+{
+	size_t len = measureJson(doc);
+	auto buffer = socket.makeBuffer(len);
+	if (buffer)
+		serializeJson(doc, (char *)buffer->get(), len + 1);
+	return buffer;
+}
@@ -0,0 +1,9 @@
+// ROM CRC32 for host tests, same polynomial and conditioning as zlib
+#pragma once
+#include <stdint.h>
+#include <zlib.h>
+
+inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	return crc32(crc, buf, len);
+}
@@ -0,0 +1,73 @@
+// ROM miniz inflate API on top of zlib for host tests
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+typedef enum
+{
+	TINFL_STATUS_BAD_PARAM = -3,
+	TINFL_STATUS_ADLER32_MISMATCH = -2,
+	TINFL_STATUS_FAILED = -1,
+	TINFL_STATUS_DONE = 0,
+	TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+	TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+// zlib keeps its own window, output may go anywhere in the dictionary
+struct tinfl_decompressor
+{
+	z_stream z;
+	bool started;
+	bool done;
+	bool failed;
+};
+
+inline void tinfl_init(tinfl_decompressor *r)
+{
+	memset(r, 0, sizeof(*r));
+}
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in, size_t *inSize, uint8_t *outStart, uint8_t *outNext, size_t *outSize, uint32_t flags)
+{
+	(void)outStart;
+	(void)flags;
+	if (r->failed)
+		return TINFL_STATUS_FAILED;
+	if (r->done)
+	{
+		*inSize = 0;
+		*outSize = 0;
+		return TINFL_STATUS_DONE;
+	}
+	if (!r->started)
+	{
+		if (inflateInit2(&r->z, -15) != Z_OK)
+			return TINFL_STATUS_FAILED;
+		r->started = true;
+	}
+	r->z.next_in = (Bytef *)in;
+	r->z.avail_in = *inSize;
+	r->z.next_out = outNext;
+	r->z.avail_out = *outSize;
+	int ret = inflate(&r->z, Z_NO_FLUSH);
+	*inSize -= r->z.avail_in;
+	*outSize -= r->z.avail_out;
+	if (ret == Z_STREAM_END)
+	{
+		inflateEnd(&r->z);
+		r->done = true;
+		return TINFL_STATUS_DONE;
+	}
+	if (ret != Z_OK && ret != Z_BUF_ERROR)
+	{
+		inflateEnd(&r->z);
+		r->failed = true;
+		return TINFL_STATUS_FAILED;
+	}
+	return r->z.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
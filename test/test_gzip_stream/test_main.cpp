@@ -0,0 +1,261 @@
+// GzipStream on host: gzip images built with zlib go through a fake flash writer
+#include <unity.h>
+#include <vector>
+#include <string>
+#include "gzip_stream.h"
+
+#define FHCRC 0x02
+#define FEXTRA 0x04
+#define FNAME 0x08
+#define FCOMMENT 0x10
+
+// Collects inflated image like Update.write()
+struct FakeFlash
+{
+	std::vector<uint8_t> data;
+	size_t writes = 0;
+	size_t maxChunk = 0;
+	size_t failAt = 0; // Fail write when image reaches this size, 0 - never
+
+	GzipStream::Writer writer()
+	{
+		return [this](const uint8_t *buf, size_t len)
+		{
+			if (failAt && data.size() + len >= failAt)
+				return false;
+			data.insert(data.end(), buf, buf + len);
+			writes++;
+			if (len > maxChunk)
+				maxChunk = len;
+			return true;
+		};
+	}
+};
+
+// Firmware-like image: code-ish repeats and random tables, larger than inflate dictionary
+std::vector<uint8_t> image(size_t size)
+{
+	std::vector<uint8_t> out(size);
+	uint32_t x = 12345;
+	for (size_t i = 0; i < size; i++)
+	{
+		x = x * 1103515245 + 12345;
+		out[i] = (i / 4096) % 3 == 0 ? (x >> 16) & 0xFF : "\x00\x40\x3c\x12\x36\x41\x00\xe0"[i % 8] + (i / 8192);
+	}
+	return out;
+}
+
+void put32(std::vector<uint8_t> &out, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		out.push_back(v >> (8 * i));
+}
+
+// Gzip member with optional header fields
+std::vector<uint8_t> gzip(const std::vector<uint8_t> &data, uint8_t flags)
+{
+	std::vector<uint8_t> out = {0x1f, 0x8b, 8, flags, 0x78, 0x56, 0x34, 0x12, 2, 3};
+	if (flags & FEXTRA)
+	{
+		const char extra[] = "AP\x04\x00test";
+		out.push_back(sizeof(extra) - 1);
+		out.push_back(0);
+		out.insert(out.end(), extra, extra + sizeof(extra) - 1);
+	}
+	if (flags & FNAME)
+	{
+		const char name[] = "firmware.bin";
+		out.insert(out.end(), name, name + sizeof(name));
+	}
+	if (flags & FCOMMENT)
+	{
+		const char comment[] = "release build";
+		out.insert(out.end(), comment, comment + sizeof(comment));
+	}
+	if (flags & FHCRC)
+	{
+		out.push_back(0xAB);
+		out.push_back(0xCD);
+	}
+
+	z_stream z = {};
+	deflateInit2(&z, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	std::vector<uint8_t> deflated(deflateBound(&z, data.size()));
+	z.next_in = (Bytef *)data.data();
+	z.avail_in = data.size();
+	z.next_out = deflated.data();
+	z.avail_out = deflated.size();
+	deflate(&z, Z_FINISH);
+	deflated.resize(z.total_out);
+	deflateEnd(&z);
+	out.insert(out.end(), deflated.begin(), deflated.end());
+
+	put32(out, crc32(0, data.data(), data.size()));
+	put32(out, data.size());
+	return out;
+}
+
+// Feed stream in chunks of given size, 0 - whole stream at once
+bool feed(GzipStream &gz, const std::vector<uint8_t> &gz_data, size_t chunk)
+{
+	if (!chunk)
+		chunk = gz_data.size();
+	for (size_t i = 0; i < gz_data.size(); i += chunk)
+		if (!gz.write(gz_data.data() + i, std::min(chunk, gz_data.size() - i)))
+			return false;
+	return true;
+}
+
+std::vector<uint8_t> img;
+GzipStream gz;
+FakeFlash flash;
+
+void setUp(void)
+{
+	flash = FakeFlash();
+	TEST_ASSERT_TRUE(gz.begin(flash.writer()));
+}
+
+void tearDown(void)
+{
+	gz.end();
+}
+
+void test_whole_stream(void)
+{
+	TEST_ASSERT_TRUE(feed(gz, gzip(img, 0), 0));
+	TEST_ASSERT_TRUE(gz.finished());
+	TEST_ASSERT_NULL(gz.error());
+	TEST_ASSERT_EQUAL(img.size(), gz.outputSize());
+	TEST_ASSERT_TRUE(flash.data == img);
+	TEST_ASSERT_LESS_OR_EQUAL(TINFL_LZ_DICT_SIZE, flash.maxChunk);
+}
+
+// Every header field split between chunks
+void test_byte_by_byte_with_all_header_fields(void)
+{
+	TEST_ASSERT_TRUE(feed(gz, gzip(img, FEXTRA | FNAME | FCOMMENT | FHCRC), 1));
+	TEST_ASSERT_TRUE(gz.finished());
+	TEST_ASSERT_TRUE(flash.data == img);
+}
+
+void test_name_and_extra_in_odd_chunks(void)
+{
+	std::vector<uint8_t> data = gzip(img, FEXTRA | FNAME);
+	size_t sizes[] = {3, 7, 11, 1460, 4096};
+	for (size_t chunk : sizes)
+	{
+		setUp();
+		TEST_ASSERT_TRUE(feed(gz, data, chunk));
+		TEST_ASSERT_TRUE(gz.finished());
+		TEST_ASSERT_TRUE(flash.data == img);
+	}
+}
+
+void test_empty_extra_field(void)
+{
+	std::vector<uint8_t> data = gzip(img, FNAME);
+	data[3] |= FEXTRA;
+	data.insert(data.begin() + 10, {0, 0});
+	TEST_ASSERT_TRUE(feed(gz, data, 5));
+	TEST_ASSERT_TRUE(gz.finished());
+}
+
+void test_bad_crc(void)
+{
+	std::vector<uint8_t> data = gzip(img, FNAME);
+	data[data.size() - 8] ^= 0x01;
+	TEST_ASSERT_FALSE(feed(gz, data, 512));
+	TEST_ASSERT_FALSE(gz.finished());
+	TEST_ASSERT_EQUAL_STRING("CRC mismatch", gz.error());
+}
+
+void test_bad_size(void)
+{
+	std::vector<uint8_t> data = gzip(img, 0);
+	data[data.size() - 4] ^= 0x01;
+	TEST_ASSERT_FALSE(feed(gz, data, 0));
+	TEST_ASSERT_EQUAL_STRING("size mismatch", gz.error());
+}
+
+void test_truncated_trailer(void)
+{
+	std::vector<uint8_t> data = gzip(img, 0);
+	data.resize(data.size() - 3);
+	TEST_ASSERT_TRUE(feed(gz, data, 1024));
+	TEST_ASSERT_FALSE(gz.finished());
+	TEST_ASSERT_EQUAL_STRING("truncated stream", gz.error());
+}
+
+void test_truncated_deflate_data(void)
+{
+	std::vector<uint8_t> data = gzip(img, FNAME);
+	data.resize(data.size() / 2);
+	TEST_ASSERT_TRUE(feed(gz, data, 1024));
+	TEST_ASSERT_FALSE(gz.finished());
+	TEST_ASSERT_EQUAL_STRING("truncated stream", gz.error());
+	TEST_ASSERT_LESS_THAN(img.size(), flash.data.size());
+}
+
+void test_truncated_header(void)
+{
+	std::vector<uint8_t> data = gzip(img, FNAME);
+	data.resize(14);
+	TEST_ASSERT_TRUE(feed(gz, data, 1));
+	TEST_ASSERT_FALSE(gz.finished());
+	TEST_ASSERT_EQUAL(0, flash.data.size());
+}
+
+void test_not_gzip(void)
+{
+	std::vector<uint8_t> data = gzip(img, 0);
+	data[1] = 0x00;
+	TEST_ASSERT_FALSE(feed(gz, data, 0));
+	TEST_ASSERT_EQUAL_STRING("not a gzip image", gz.error());
+}
+
+void test_corrupted_deflate_data(void)
+{
+	std::vector<uint8_t> data = gzip(img, 0);
+	for (size_t i = 100; i < 140; i++)
+		data[i] ^= 0x5A;
+	feed(gz, data, 256);
+	TEST_ASSERT_FALSE(gz.finished());
+	TEST_ASSERT_NOT_NULL(gz.error());
+}
+
+void test_writer_failure(void)
+{
+	flash.failAt = 50000;
+	TEST_ASSERT_TRUE(gz.begin(flash.writer()));
+	TEST_ASSERT_FALSE(feed(gz, gzip(img, 0), 1024));
+	TEST_ASSERT_EQUAL_STRING("write error", gz.error());
+}
+
+void test_data_after_end(void)
+{
+	std::vector<uint8_t> data = gzip(img, 0);
+	data.push_back(0);
+	TEST_ASSERT_FALSE(feed(gz, data, 0));
+	TEST_ASSERT_EQUAL_STRING("data after end of stream", gz.error());
+}
+
+int main(int argc, char **argv)
+{
+	img = image(100000);
+	UNITY_BEGIN();
+	RUN_TEST(test_whole_stream);
+	RUN_TEST(test_byte_by_byte_with_all_header_fields);
+	RUN_TEST(test_name_and_extra_in_odd_chunks);
+	RUN_TEST(test_empty_extra_field);
+	RUN_TEST(test_bad_crc);
+	RUN_TEST(test_bad_size);
+	RUN_TEST(test_truncated_trailer);
+	RUN_TEST(test_truncated_deflate_data);
+	RUN_TEST(test_truncated_header);
+	RUN_TEST(test_not_gzip);
+	RUN_TEST(test_corrupted_deflate_data);
+	RUN_TEST(test_writer_failure);
+	RUN_TEST(test_data_after_end);
+	return UNITY_END();
+}
@@ -0,0 +1,126 @@
+// Board profiles on host: pin levels in shadow registers and shade to position scale
+#include <unity.h>
+#include "hardware.h"
+
+typedef Hardware<Esp32DevBoard, DirectMotor> Esp32Dev;
+typedef Hardware<Tmc2209Board, Microstep8Motor> Tmc2209;
+
+bool out(uint8_t pin)
+{
+	return (HostGpio<>::out >> pin) & 1;
+}
+
+void setUp(void)
+{
+	HostGpio<>::out = 0;
+	HostGpio<>::in = 0;
+}
+
+void tearDown(void) {}
+
+void test_host_profile(void)
+{
+	TEST_ASSERT_EQUAL(Esp32DevBoard::dirPin, Hw::dirPin);
+	TEST_ASSERT_EQUAL(Esp32DevBoard::stepPin, Hw::stepPin);
+	TEST_ASSERT_TRUE(Hw::accel > 0);
+	TEST_ASSERT_EQUAL(125, Hw::halfPeriod);
+	TEST_ASSERT_EQUAL(400, Hw::minSpeed);
+}
+
+void test_enable_is_active_low(void)
+{
+	Esp32Dev::enable(true);
+	TEST_ASSERT_FALSE(out(Esp32DevBoard::nEnPin));
+	Esp32Dev::enable(false);
+	TEST_ASSERT_TRUE(out(Esp32DevBoard::nEnPin));
+	Tmc2209::enable(false);
+	TEST_ASSERT_TRUE(out(Tmc2209Board::nEnPin));
+}
+
+void test_direction_level_per_board(void)
+{
+	Esp32Dev::direction(true);
+	TEST_ASSERT_TRUE(out(Esp32DevBoard::dirPin));
+	Esp32Dev::direction(false);
+	TEST_ASSERT_FALSE(out(Esp32DevBoard::dirPin));
+	Tmc2209::direction(true);
+	TEST_ASSERT_FALSE(out(Tmc2209Board::dirPin));
+	Tmc2209::direction(false);
+	TEST_ASSERT_TRUE(out(Tmc2209Board::dirPin));
+}
+
+void test_step_and_led_touch_only_their_pins(void)
+{
+	Esp32Dev::step(true);
+	TEST_ASSERT_EQUAL_HEX32(1UL << Esp32DevBoard::stepPin, (uint32_t)HostGpio<>::out);
+	Esp32Dev::led(true);
+	Esp32Dev::step(false);
+	TEST_ASSERT_EQUAL_HEX32(1UL << Esp32DevBoard::ledPin, (uint32_t)HostGpio<>::out);
+	Tmc2209::led(true);
+	TEST_ASSERT_TRUE(out(Tmc2209Board::ledPin));
+	TEST_ASSERT_TRUE(out(Esp32DevBoard::ledPin));
+}
+
+void test_switch_polarity(void)
+{
+	// Esp32Dev switch pulls to ground, TMC2209 carrier switches to 3.3 V
+	TEST_ASSERT_TRUE(Esp32Dev::switchPressed());
+	TEST_ASSERT_FALSE(Tmc2209::switchPressed());
+	HostGpio<>::in = (1ULL << Esp32DevBoard::switchPin) | (1ULL << Tmc2209Board::switchPin);
+	TEST_ASSERT_FALSE(Esp32Dev::switchPressed());
+	TEST_ASSERT_TRUE(Tmc2209::switchPressed());
+}
+
+void test_motor_profiles(void)
+{
+	TEST_ASSERT_EQUAL(1000, DirectMotor::halfPeriod);
+	TEST_ASSERT_EQUAL(0, DirectMotor::accel);
+	TEST_ASSERT_TRUE(Microstep8Motor::stepsPerMm > 26.66f && Microstep8Motor::stepsPerMm < 26.67f);
+}
+
+void test_shade_to_pos(void)
+{
+	TEST_ASSERT_EQUAL(0, shadeToPos(0, 12345));
+	TEST_ASSERT_EQUAL(12345, shadeToPos(SHADE_MAX, 12345));
+	TEST_ASSERT_EQUAL(6172, shadeToPos(50, 12345));
+	// Long microstepped shades do not overflow
+	TEST_ASSERT_EQUAL(90000000, shadeToPos(90, 100000000));
+}
+
+void test_pos_to_shade(void)
+{
+	TEST_ASSERT_EQUAL(0, posToShade(0, 12345));
+	TEST_ASSERT_EQUAL(SHADE_MAX, posToShade(12345, 12345));
+	TEST_ASSERT_EQUAL(49, posToShade(6172, 12345));
+	TEST_ASSERT_EQUAL(0, posToShade(500, 0));
+	TEST_ASSERT_EQUAL(90, posToShade(90000000, 100000000));
+}
+
+void test_shade_round_trip(void)
+{
+	// At least one step per percent
+	const int lengths[] = {100, 101, 299, 3000, 24000, 1000003};
+	for (int length : lengths)
+		for (int shade = 0; shade <= SHADE_MAX; shade++)
+		{
+			int pos = shadeToPos(shade, length);
+			TEST_ASSERT_TRUE(pos >= 0 && pos <= length);
+			// Truncation loses at most one percent
+			TEST_ASSERT_INT_WITHIN(1, shade, posToShade(pos, length));
+		}
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_host_profile);
+	RUN_TEST(test_enable_is_active_low);
+	RUN_TEST(test_direction_level_per_board);
+	RUN_TEST(test_step_and_led_touch_only_their_pins);
+	RUN_TEST(test_switch_polarity);
+	RUN_TEST(test_motor_profiles);
+	RUN_TEST(test_shade_to_pos);
+	RUN_TEST(test_pos_to_shade);
+	RUN_TEST(test_shade_round_trip);
+	return UNITY_END();
+}
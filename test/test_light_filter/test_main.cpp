@@ -0,0 +1,172 @@
+// LightFilter on host: synthetic day traces at the DMA block rate, checks move decisions and frequency
+#include <unity.h>
+#include <vector>
+#include <math.h>
+#include "light_filter.h"
+
+#define BLOCK_MS 100 // 1000 samples at 10 kHz
+#define MINUTE 60000UL
+
+struct Move
+{
+	uint32_t ms;
+	int shade;
+};
+
+LightSettings cfg;
+LightFilter filter;
+std::vector<Move> moves;
+uint32_t clockMs; // millis() of next block
+uint32_t noiseSeed;
+
+void setUp(void)
+{
+	cfg = {true, 3000, 1500, 100, 0, 60000, 600000};
+	filter = LightFilter();
+	moves.clear();
+	clockMs = 0;
+	noiseSeed = 1;
+}
+
+void tearDown(void) {}
+
+// Block average with sensor noise, clamped to 12-bit ADC range
+uint16_t sample(double level, int noise)
+{
+	noiseSeed = noiseSeed * 1103515245 + 12345;
+	int v = (int)level + (noise ? (int)((noiseSeed >> 16) % (2 * noise + 1)) - noise : 0);
+	return v < 0 ? 0 : v > 4095 ? 4095 : v;
+}
+
+// Feed trace for duration, level is a function of ms since trace start, moves are stamped the same way
+template <class Level>
+void run(uint32_t duration, Level level, int noise = 100)
+{
+	for (uint32_t t = 0; t < duration; t += BLOCK_MS)
+	{
+		int shade = filter.update(sample(level(t), noise), clockMs + t, cfg);
+		if (shade >= 0)
+			moves.push_back({t, shade});
+	}
+	clockMs += duration;
+}
+
+// Linear ramp between two levels over given time, flat after it
+double ramp(uint32_t t, double from, double to, uint32_t length)
+{
+	return t >= length ? to : from + (to - from) * t / length;
+}
+
+// Trace starts in a settled state past the minimum interval, so later moves are caused by the trace only
+void settle(double level)
+{
+	run(15 * MINUTE, [=](uint32_t) { return level; }, 0);
+	TEST_ASSERT_EQUAL(1, moves.size());
+	moves.clear();
+}
+
+void test_dawn_ramp_moves_once(void)
+{
+	settle(500);
+	run(120 * MINUTE, [](uint32_t t) { return ramp(t, 500, 3800, 40 * MINUTE); });
+	TEST_ASSERT_EQUAL(1, moves.size());
+	TEST_ASSERT_EQUAL(cfg.shadeBright, moves[0].shade);
+	// Ramp crosses high threshold at 3000, hold adds one minute, filter lag a few seconds
+	uint32_t crossing = (uint32_t)((3000.0 - 500) / (3800 - 500) * 40 * MINUTE);
+	TEST_ASSERT_GREATER_OR_EQUAL(crossing + cfg.holdMs, moves[0].ms);
+	TEST_ASSERT_LESS_THAN(crossing + cfg.holdMs + 2 * MINUTE, moves[0].ms);
+}
+
+void test_dusk_ramp_moves_once(void)
+{
+	settle(3800);
+	run(120 * MINUTE, [](uint32_t t) { return ramp(t, 3800, 200, 30 * MINUTE); });
+	TEST_ASSERT_EQUAL(1, moves.size());
+	TEST_ASSERT_EQUAL(cfg.shadeDark, moves[0].shade);
+}
+
+void test_cloud_flicker_does_not_move(void)
+{
+	settle(3800);
+	// Clouds drop light below low threshold for 30 s every 3 minutes for two hours
+	run(120 * MINUTE, [](uint32_t t) { return t % (3 * MINUTE) < 30000 ? 900 : 3800; }, 300);
+	TEST_ASSERT_EQUAL(0, moves.size());
+}
+
+void test_short_shadow_does_not_move(void)
+{
+	settle(3800);
+	run(10 * MINUTE, [](uint32_t t) { return t > MINUTE && t < MINUTE + 45000 ? 300 : 3800; });
+	TEST_ASSERT_EQUAL(0, moves.size());
+}
+
+void test_long_shadow_moves_and_returns_after_interval(void)
+{
+	settle(3800);
+	// Building shadow for 3 minutes, then sun again
+	run(30 * MINUTE, [](uint32_t t) { return t > MINUTE && t < 4 * MINUTE ? 300 : 3800; });
+	TEST_ASSERT_EQUAL(2, moves.size());
+	TEST_ASSERT_EQUAL(cfg.shadeDark, moves[0].shade);
+	TEST_ASSERT_EQUAL(cfg.shadeBright, moves[1].shade);
+	// Sun is back after 4 minutes but the return waits for the minimum interval
+	TEST_ASSERT_GREATER_OR_EQUAL(cfg.minIntervalMs, moves[1].ms - moves[0].ms);
+}
+
+void test_level_between_thresholds_keeps_state(void)
+{
+	settle(3800);
+	// Overcast day wandering inside the hysteresis band with noise
+	run(240 * MINUTE, [](uint32_t t) { return 2250 + 550 * sin(t / 200000.0); }, 150);
+	TEST_ASSERT_EQUAL(0, moves.size());
+}
+
+void test_unknown_state_waits_for_threshold(void)
+{
+	run(30 * MINUTE, [](uint32_t) { return 2200; });
+	TEST_ASSERT_EQUAL(0, moves.size());
+	run(5 * MINUTE, [](uint32_t) { return 3500; });
+	TEST_ASSERT_EQUAL(1, moves.size());
+	TEST_ASSERT_EQUAL(cfg.shadeBright, moves[0].shade);
+}
+
+void test_move_frequency_is_limited(void)
+{
+	settle(3800);
+	// Light alternating every 2 minutes, each phase longer than hold time
+	run(240 * MINUTE, [](uint32_t t) { return (t / (2 * MINUTE)) % 2 ? 3800 : 300; });
+	TEST_ASSERT_GREATER_THAN(0, moves.size());
+	TEST_ASSERT_LESS_OR_EQUAL(240 * MINUTE / cfg.minIntervalMs + 1, moves.size());
+	for (size_t i = 1; i < moves.size(); i++)
+	{
+		TEST_ASSERT_GREATER_OR_EQUAL(cfg.minIntervalMs, moves[i].ms - moves[i - 1].ms);
+		TEST_ASSERT_TRUE(moves[i].shade != moves[i - 1].shade);
+	}
+}
+
+void test_millis_wrap(void)
+{
+	clockMs = 0xFFFFFFFFUL - 2 * MINUTE;
+	run(5 * MINUTE, [](uint32_t) { return 300; });
+	TEST_ASSERT_EQUAL(1, moves.size());
+	moves.clear();
+	// Sun returns right after wrap, interval counts across it
+	run(20 * MINUTE, [](uint32_t) { return 3800; });
+	TEST_ASSERT_EQUAL(1, moves.size());
+	TEST_ASSERT_EQUAL(cfg.shadeBright, moves[0].shade);
+	TEST_ASSERT_GREATER_OR_EQUAL(cfg.minIntervalMs - 5 * MINUTE, moves[0].ms);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_dawn_ramp_moves_once);
+	RUN_TEST(test_dusk_ramp_moves_once);
+	RUN_TEST(test_cloud_flicker_does_not_move);
+	RUN_TEST(test_short_shadow_does_not_move);
+	RUN_TEST(test_long_shadow_moves_and_returns_after_interval);
+	RUN_TEST(test_level_between_thresholds_keeps_state);
+	RUN_TEST(test_unknown_state_waits_for_threshold);
+	RUN_TEST(test_move_frequency_is_limited);
+	RUN_TEST(test_millis_wrap);
+	return UNITY_END();
+}
@@ -0,0 +1,257 @@
+// MotionQueue on host: simulated stepper runs the motor loop steps against simulated time
+#include <unity.h>
+#include <vector>
+#include <math.h>
+#include "motion_queue.h"
+
+#define LENGTH 20000 // Shade length, steps
+
+// Motor loop state after each step or idle pass
+struct Sample
+{
+	double ms;
+	int pos;
+	int dir;
+	float rate;
+};
+
+// Same order as main loop: service queue, pick direction, move one step, step pulse with ramp half period
+template <class Motor>
+struct Sim
+{
+	MotionQueue<Motor> queue;
+	int pos = 0;
+	int shade = 0;
+	int dir = 0;
+	double us = 0;
+	std::vector<Sample> log;
+
+	unsigned long ms() const { return (unsigned long)(us / 1000); }
+
+	void add(uint8_t shade, uint16_t dwell = 0, uint16_t speed = 0)
+	{
+		TEST_ASSERT_TRUE(queue.enqueue({shade, dwell, speed}));
+	}
+
+	void pass()
+	{
+		Waypoint next;
+		bool blended;
+		queue.service(ms(), pos, shade, LENGTH, dir, next, blended);
+		int target = shadeToPos(shade, LENGTH);
+		dir = pos < target ? 1 : (pos > target ? -1 : 0);
+		if (dir == 0)
+		{
+			queue.stop();
+			us += 1000; // Idle wake
+		}
+		else
+		{
+			pos += dir;
+			us += 2.0 * queue.rampHalfPeriod(pos, target, LENGTH, dir, true);
+		}
+		log.push_back({us / 1000, pos, dir, queue.rate()});
+	}
+
+	// Run until queue is drained and motor stopped
+	void run()
+	{
+		for (int i = 0; i < 10000000; i++)
+		{
+			pass();
+			if (dir == 0 && !queue.pending() && queue.dwellLeft(ms()) < 0 && queue.count() == 0)
+			{
+				pass(); // Last waypoint is released on the pass after arrival
+				return;
+			}
+		}
+		TEST_FAIL_MESSAGE("simulation did not finish");
+	}
+
+	// First log entry at position, -1 if never reached
+	int reach(int p, size_t from = 0) const
+	{
+		for (size_t i = from; i < log.size(); i++)
+			if (log[i].pos == p)
+				return i;
+		return -1;
+	}
+
+	// Motor stop passes between two log entries
+	int stops(size_t from, size_t to) const
+	{
+		int n = 0;
+		for (size_t i = from; i < to && i < log.size(); i++)
+			if (log[i].dir == 0)
+				n++;
+		return n;
+	}
+};
+
+typedef Microstep8Motor Motor;
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_queue_capacity(void)
+{
+	MotionQueue<Motor> queue;
+	for (int i = 0; i < MOTION_QUEUE_SIZE; i++)
+		TEST_ASSERT_TRUE(queue.enqueue({(uint8_t)(i * 10), 0, 0}));
+	TEST_ASSERT_FALSE(queue.enqueue({90, 0, 0}));
+	TEST_ASSERT_EQUAL(MOTION_QUEUE_SIZE, queue.count());
+	TEST_ASSERT_EQUAL(0, queue.free());
+	Waypoint copy[MOTION_QUEUE_SIZE + 1];
+	TEST_ASSERT_EQUAL(MOTION_QUEUE_SIZE, queue.copy(copy));
+	TEST_ASSERT_EQUAL(70, copy[7].shade);
+	queue.clear();
+	TEST_ASSERT_EQUAL(0, queue.count());
+	TEST_ASSERT_FALSE(queue.pending());
+}
+
+void test_same_direction_blends_without_stop(void)
+{
+	Sim<Motor> sim;
+	sim.add(30);
+	sim.add(60);
+	sim.add(90);
+	sim.run();
+	int start = sim.reach(1);
+	int at30 = sim.reach(shadeToPos(30, LENGTH));
+	int at60 = sim.reach(shadeToPos(60, LENGTH));
+	int at90 = sim.reach(shadeToPos(90, LENGTH));
+	TEST_ASSERT_TRUE(start >= 0 && at30 > start && at60 > at30 && at90 > at60);
+	TEST_ASSERT_EQUAL(0, sim.stops(start, at90));
+	// Passing through waypoints at cruise speed, braking only for the last one
+	TEST_ASSERT_EQUAL(Motor::maxSpeed, sim.log[at30].rate);
+	TEST_ASSERT_EQUAL(Motor::maxSpeed, sim.log[at60].rate);
+	TEST_ASSERT_LESS_THAN(Motor::minSpeed * 2, sim.log[at90].rate);
+	TEST_ASSERT_EQUAL(shadeToPos(90, LENGTH), sim.pos);
+}
+
+void test_direction_change_stops(void)
+{
+	Sim<Motor> sim;
+	sim.add(60);
+	sim.add(20);
+	sim.run();
+	int at60 = sim.reach(shadeToPos(60, LENGTH));
+	int at20 = sim.reach(shadeToPos(20, LENGTH), at60);
+	TEST_ASSERT_TRUE(at60 > 0 && at20 > at60);
+	TEST_ASSERT_LESS_THAN(Motor::minSpeed * 2, sim.log[at60].rate);
+	TEST_ASSERT_GREATER_THAN(0, sim.stops(at60, at20));
+	TEST_ASSERT_LESS_THAN(Motor::minSpeed * 2, sim.log[at20].rate);
+	TEST_ASSERT_EQUAL(shadeToPos(20, LENGTH), sim.pos);
+}
+
+void test_dwell_holds_motor(void)
+{
+	Sim<Motor> sim;
+	sim.add(50, 2);
+	sim.add(80);
+	sim.run();
+	int at50 = sim.reach(shadeToPos(50, LENGTH));
+	int leave = sim.reach(shadeToPos(50, LENGTH) + 1);
+	TEST_ASSERT_TRUE(at50 > 0 && leave > at50);
+	// Motor does not blend through a waypoint with dwell
+	TEST_ASSERT_LESS_THAN(Motor::minSpeed * 2, sim.log[at50].rate);
+	TEST_ASSERT_GREATER_OR_EQUAL(2000, sim.log[leave].ms - sim.log[at50].ms);
+	TEST_ASSERT_LESS_THAN(2100, sim.log[leave].ms - sim.log[at50].ms);
+	TEST_ASSERT_EQUAL(shadeToPos(80, LENGTH), sim.pos);
+}
+
+void test_dwell_is_not_pending_work(void)
+{
+	Sim<Motor> sim;
+	sim.add(10, 5);
+	sim.add(20);
+	while (sim.queue.dwellLeft(sim.ms()) < 0)
+		sim.pass();
+	TEST_ASSERT_FALSE(sim.queue.pending());
+	TEST_ASSERT_INT_WITHIN(1, 5000, sim.queue.dwellLeft(sim.ms()));
+	sim.queue.clear();
+	TEST_ASSERT_EQUAL(-1, sim.queue.dwellLeft(sim.ms()));
+	TEST_ASSERT_EQUAL(0, sim.queue.count());
+}
+
+void test_ramp_respects_speed_and_acceleration(void)
+{
+	Sim<Motor> sim;
+	sim.add(40, 0, 2000);
+	sim.add(70);
+	sim.run();
+	int at40 = sim.reach(shadeToPos(40, LENGTH));
+	float top = 0;
+	for (int i = 0; i < at40; i++)
+		top = sim.log[i].rate > top ? sim.log[i].rate : top;
+	TEST_ASSERT_EQUAL(2000, top);
+	// Speed change per step is at most accel / rate, a = dv/dt = v dv/dx
+	for (size_t i = 1; i < sim.log.size(); i++)
+	{
+		if (!sim.log[i].dir || !sim.log[i - 1].dir)
+			continue;
+		float prev = sim.log[i - 1].rate;
+		TEST_ASSERT_TRUE(fabs(sim.log[i].rate - prev) <= Motor::accel / prev + 0.01f);
+	}
+	TEST_ASSERT_EQUAL(Motor::maxSpeed, sim.log[sim.reach(shadeToPos(60, LENGTH))].rate);
+}
+
+void test_stopped_queue_starts_from_min_speed(void)
+{
+	Sim<Motor> sim;
+	sim.add(5);
+	sim.run();
+	TEST_ASSERT_EQUAL(Motor::minSpeed, sim.log[sim.reach(1)].rate);
+	TEST_ASSERT_EQUAL(0, sim.queue.rate());
+}
+
+void test_clear_wins_over_taken_waypoint(void)
+{
+	Sim<Motor> sim;
+	sim.add(50);
+	sim.add(80);
+	sim.pass();
+	TEST_ASSERT_EQUAL(50, sim.shade);
+	// Command clears the queue and sets its own target, service must not take queued waypoints after that
+	sim.queue.clear();
+	sim.shade = 10;
+	Waypoint copy[MOTION_QUEUE_SIZE + 1];
+	TEST_ASSERT_EQUAL(0, sim.queue.copy(copy));
+	sim.run();
+	TEST_ASSERT_EQUAL(10, sim.shade);
+	TEST_ASSERT_EQUAL(shadeToPos(10, LENGTH), sim.pos);
+	// Service leaves shade alone when queue is empty or motor is not at target
+	int shade = 33;
+	Waypoint next;
+	bool blended;
+	TEST_ASSERT_FALSE(sim.queue.service(sim.ms(), 0, shade, LENGTH, 0, next, blended));
+	TEST_ASSERT_EQUAL(33, shade);
+}
+
+void test_direct_motor_has_no_ramp(void)
+{
+	Sim<DirectMotor> sim;
+	sim.add(10, 0, 100);
+	sim.add(20);
+	sim.run();
+	// 100 steps/s on first waypoint, profile default speed on second
+	int at10 = sim.reach(shadeToPos(10, LENGTH));
+	int at20 = sim.reach(shadeToPos(20, LENGTH));
+	TEST_ASSERT_INT_WITHIN(1, 10, sim.log[at10].ms - sim.log[at10 - 1].ms);
+	TEST_ASSERT_INT_WITHIN(1, 1000 / DirectMotor::maxSpeed, sim.log[at20].ms - sim.log[at20 - 1].ms);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_queue_capacity);
+	RUN_TEST(test_same_direction_blends_without_stop);
+	RUN_TEST(test_direction_change_stops);
+	RUN_TEST(test_dwell_holds_motor);
+	RUN_TEST(test_dwell_is_not_pending_work);
+	RUN_TEST(test_ramp_respects_speed_and_acceleration);
+	RUN_TEST(test_stopped_queue_starts_from_min_speed);
+	RUN_TEST(test_clear_wins_over_taken_waypoint);
+	RUN_TEST(test_direct_motor_has_no_ramp);
+	return UNITY_END();
+}
@@ -0,0 +1,162 @@
+// Sha256Writer on host: gzip images inflate through the hash check into a fake flash writer
+#include <unity.h>
+#include <vector>
+#include <string>
+#include <zlib.h>
+#include "ota_verify.h"
+
+// Collects image like Update.write()
+struct FakeFlash
+{
+	std::vector<uint8_t> data;
+	bool full = false; // Simulate write error
+
+	GzipStream::Writer writer()
+	{
+		return [this](const uint8_t *buf, size_t len)
+		{
+			if (full)
+				return false;
+			data.insert(data.end(), buf, buf + len);
+			return true;
+		};
+	}
+};
+
+std::vector<uint8_t> image(size_t size)
+{
+	std::vector<uint8_t> out(size);
+	uint32_t x = 777;
+	for (size_t i = 0; i < size; i++)
+	{
+		x = x * 1103515245 + 12345;
+		out[i] = (i / 1024) % 2 ? (x >> 16) & 0xFF : i % 61;
+	}
+	return out;
+}
+
+// Gzip member built with zlib
+std::vector<uint8_t> gzip(const std::vector<uint8_t> &data)
+{
+	z_stream z = {};
+	deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	std::vector<uint8_t> out(deflateBound(&z, data.size()) + 32);
+	z.next_in = (Bytef *)data.data();
+	z.avail_in = data.size();
+	z.next_out = out.data();
+	z.avail_out = out.size();
+	deflate(&z, Z_FINISH);
+	out.resize(z.total_out);
+	deflateEnd(&z);
+	return out;
+}
+
+std::string hex(const std::vector<uint8_t> &data)
+{
+	mbedtls_sha256_context ctx;
+	uint8_t hash[32];
+	char out[65];
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts_ret(&ctx, 0);
+	mbedtls_sha256_update_ret(&ctx, data.data(), data.size());
+	mbedtls_sha256_finish_ret(&ctx, hash);
+	for (int i = 0; i < 32; i++)
+		sprintf(out + i * 2, "%02x", hash[i]);
+	return out;
+}
+
+// Same order as onGzOtaUpload: hash check begins first, gzip stream writes through it, verify after trailer
+const char *upload(const std::vector<uint8_t> &gz, const char *expected, FakeFlash &flash, size_t chunk = 1460)
+{
+	Sha256Writer sha;
+	GzipStream stream;
+	if (!sha.begin(flash.writer(), expected))
+		return sha.error();
+	if (!stream.begin(sha.writer()))
+		return stream.error();
+	const char *error = nullptr;
+	for (size_t i = 0; i < gz.size() && !error; i += chunk)
+		if (!stream.write(gz.data() + i, gz.size() - i < chunk ? gz.size() - i : chunk))
+			error = stream.error();
+	if (!error && !stream.finished())
+		error = stream.error();
+	stream.end();
+	if (error)
+	{
+		sha.end();
+		return error;
+	}
+	return sha.verify() ? nullptr : sha.error();
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_known_digests(void)
+{
+	TEST_ASSERT_EQUAL_STRING("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", hex({}).c_str());
+	TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hex({'a', 'b', 'c'}).c_str());
+	// Million 'a' in uneven chunks through the writer
+	FakeFlash flash;
+	Sha256Writer sha;
+	TEST_ASSERT_TRUE(sha.begin(flash.writer(), "CDC76E5C9914FB9281A1C7E284D73E67F1809A48A497200E046D39CCC7112CD0"));
+	GzipStream::Writer write = sha.writer();
+	std::vector<uint8_t> a(1000, 'a');
+	for (size_t done = 0, n = 1; done < 1000000; done += n, n = n % 997 + 1)
+		TEST_ASSERT_TRUE(write(a.data(), 1000000 - done < n ? 1000000 - done : n));
+	TEST_ASSERT_TRUE(sha.verify());
+	TEST_ASSERT_EQUAL(1000000, flash.data.size());
+}
+
+void test_matching_hash_accepts_image(void)
+{
+	std::vector<uint8_t> data = image(200000);
+	FakeFlash flash;
+	TEST_ASSERT_NULL(upload(gzip(data), hex(data).c_str(), flash));
+	TEST_ASSERT_TRUE(flash.data == data);
+}
+
+void test_mismatching_hash_rejects_valid_gzip(void)
+{
+	std::vector<uint8_t> data = image(200000);
+	std::string expected = hex(data);
+	// Gzip CRC is fine, image differs from the one the hash was made for
+	data[123456] ^= 1;
+	FakeFlash flash;
+	TEST_ASSERT_EQUAL_STRING("sha256 mismatch", upload(gzip(data), expected.c_str(), flash));
+	// Last digit off
+	data[123456] ^= 1;
+	expected[63] = expected[63] == '0' ? '1' : '0';
+	TEST_ASSERT_EQUAL_STRING("sha256 mismatch", upload(gzip(data), expected.c_str(), flash));
+}
+
+void test_hash_is_required(void)
+{
+	FakeFlash flash;
+	std::vector<uint8_t> gz = gzip(image(1000));
+	TEST_ASSERT_EQUAL_STRING("sha256 of uncompressed image is required", upload(gz, nullptr, flash));
+	TEST_ASSERT_EQUAL_STRING("sha256 of uncompressed image is required", upload(gz, "abc", flash));
+	TEST_ASSERT_EQUAL(0, flash.data.size());
+	Sha256Writer sha;
+	sha.begin(flash.writer(), "");
+	TEST_ASSERT_FALSE(sha.verify());
+}
+
+void test_write_error_passes_through(void)
+{
+	std::vector<uint8_t> data = image(50000);
+	FakeFlash flash;
+	flash.full = true;
+	TEST_ASSERT_EQUAL_STRING("write error", upload(gzip(data), hex(data).c_str(), flash));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_known_digests);
+	RUN_TEST(test_matching_hash_accepts_image);
+	RUN_TEST(test_mismatching_hash_rejects_valid_gzip);
+	RUN_TEST(test_hash_is_required);
+	RUN_TEST(test_write_error_passes_through);
+	return UNITY_END();
+}
@@ -0,0 +1,186 @@
+// jsonBuffer on host: fake web socket counts buffer bytes and copies, compared with the old 2 KB ws_data path
+#include <unity.h>
+#include <ArduinoJson.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "ws_json.h"
+
+// Same layout as AsyncWebSocketMessageBuffer: length bytes plus terminating zero
+struct FakeBuffer
+{
+	std::vector<uint8_t> data;
+	uint8_t *get() { return data.data(); }
+	size_t length() const { return data.size() - 1; }
+};
+
+// Records message buffers like AsyncWebSocket
+struct FakeSocket
+{
+	std::vector<FakeBuffer *> buffers;
+	size_t allocated = 0; // Message buffer bytes
+	size_t copied = 0;	  // Bytes copied from caller memory into message buffers
+	bool full = false;	  // Simulate out of memory
+
+	~FakeSocket()
+	{
+		for (FakeBuffer *buffer : buffers)
+			delete buffer;
+	}
+
+	FakeBuffer *makeBuffer(size_t len)
+	{
+		if (full)
+			return nullptr;
+		FakeBuffer *buffer = new FakeBuffer;
+		buffer->data.assign(len + 1, 0xA5);
+		buffer->data[len] = 0;
+		allocated += len + 1;
+		buffers.push_back(buffer);
+		return buffer;
+	}
+
+	// textAll(const char *, size_t): message gets its own copy of caller data
+	void textAll(const char *message, size_t len)
+	{
+		FakeBuffer *buffer = makeBuffer(len);
+		memcpy(buffer->get(), message, len);
+		copied += len;
+	}
+};
+
+// History page like historyToJson(): records of [time, source, from, to, duration, flags]. Device pages
+// hold 20 records, larger counts stand for replies over the old 2 KB buffer
+void history(JsonDocument &doc, int records)
+{
+	JsonArray list = doc.createNestedArray("history");
+	doc["page"] = 0;
+	doc["more"] = true;
+	for (int i = 0; i < records; i++)
+	{
+		JsonArray record = list.createNestedArray();
+		record.add(1700000000 + i * 37);
+		record.add(i % 7);
+		record.add(i % 101);
+		record.add((i * 13) % 101);
+		record.add(i * 3 % 600);
+		record.add(i & 1);
+	}
+}
+
+std::string expected(const JsonDocument &doc)
+{
+	std::string out;
+	serializeJson(doc, out);
+	return out;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_small_message(void)
+{
+	FakeSocket ws;
+	DynamicJsonDocument doc(256);
+	doc["error"] = "queueShade: shade is not calibrated";
+	FakeBuffer *buffer = jsonBuffer(ws, doc);
+	TEST_ASSERT_NOT_NULL(buffer);
+	TEST_ASSERT_EQUAL(measureJson(doc), buffer->length());
+	TEST_ASSERT_EQUAL_STRING(expected(doc).c_str(), (const char *)buffer->get());
+}
+
+void test_large_message_is_complete(void)
+{
+	FakeSocket ws;
+	DynamicJsonDocument doc(131072);
+	history(doc, 400);
+	std::string json = expected(doc);
+	TEST_ASSERT_GREATER_THAN(4 * 2048, json.size());
+	FakeBuffer *buffer = jsonBuffer(ws, doc);
+	TEST_ASSERT_NOT_NULL(buffer);
+	TEST_ASSERT_EQUAL(json.size(), buffer->length());
+	TEST_ASSERT_EQUAL_MEMORY(json.c_str(), buffer->get(), json.size() + 1);
+	// Parses back to the same document
+	DynamicJsonDocument back(131072);
+	TEST_ASSERT_TRUE(deserializeJson(back, (const char *)buffer->get()) == DeserializationError::Ok);
+	TEST_ASSERT_EQUAL(400, back["history"].size());
+}
+
+void test_bytes_and_copies_against_static_buffer(void)
+{
+	DynamicJsonDocument doc(131072);
+	history(doc, 150);
+	std::string json = expected(doc);
+	size_t n = json.size();
+	TEST_ASSERT_GREATER_THAN(2048, n);
+
+	// Old path: serialize into static ws_data, textAll copies it into a message buffer
+	FakeSocket legacy;
+	static char ws_data[2048];
+	size_t ws_len = serializeJson(doc, ws_data);
+	legacy.textAll(ws_data, ws_len);
+	size_t legacyWrites = ws_len + legacy.copied;
+
+	// Direct path: measure without writes, serialize once into the message buffer
+	FakeSocket direct;
+	FakeBuffer *buffer = jsonBuffer(direct, doc);
+	size_t directWrites = buffer->length() + direct.copied;
+
+	char line[160];
+	snprintf(line, sizeof(line), "%u byte message: static buffer %u writes, %u sent; direct %u writes, %u sent",
+			 (unsigned)n, (unsigned)legacyWrites, (unsigned)legacy.buffers[0]->length(), (unsigned)directWrites, (unsigned)buffer->length());
+	TEST_MESSAGE(line);
+
+	// Static buffer cuts message to 2047 bytes, that is not valid JSON
+	TEST_ASSERT_EQUAL(sizeof(ws_data) - 1, legacy.buffers[0]->length());
+	DynamicJsonDocument back(131072);
+	TEST_ASSERT_FALSE(deserializeJson(back, (const char *)legacy.buffers[0]->get()) == DeserializationError::Ok);
+	TEST_ASSERT_EQUAL(2 * ws_len, legacyWrites);
+
+	// Direct path writes each byte once, no copy, one buffer of exact size
+	TEST_ASSERT_EQUAL(0, direct.copied);
+	TEST_ASSERT_EQUAL(1, direct.buffers.size());
+	TEST_ASSERT_EQUAL(n + 1, direct.allocated);
+	TEST_ASSERT_EQUAL(n, directWrites);
+	TEST_ASSERT_EQUAL_MEMORY(json.c_str(), buffer->get(), n + 1);
+}
+
+void test_small_message_has_half_the_writes(void)
+{
+	DynamicJsonDocument doc(4096);
+	history(doc, 20);
+	size_t n = measureJson(doc);
+	TEST_ASSERT_LESS_THAN(2048, n);
+
+	FakeSocket legacy;
+	static char ws_data[2048];
+	size_t ws_len = serializeJson(doc, ws_data);
+	legacy.textAll(ws_data, ws_len);
+
+	FakeSocket direct;
+	FakeBuffer *buffer = jsonBuffer(direct, doc);
+	TEST_ASSERT_EQUAL(n, ws_len);
+	TEST_ASSERT_EQUAL(2 * n, ws_len + legacy.copied);
+	TEST_ASSERT_EQUAL(n, buffer->length() + direct.copied);
+	TEST_ASSERT_EQUAL_MEMORY(legacy.buffers[0]->get(), buffer->get(), n + 1);
+}
+
+void test_no_memory(void)
+{
+	FakeSocket ws;
+	ws.full = true;
+	DynamicJsonDocument doc(256);
+	doc["x"] = 1;
+	TEST_ASSERT_NULL(jsonBuffer(ws, doc));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_small_message);
+	RUN_TEST(test_large_message_is_complete);
+	RUN_TEST(test_bytes_and_copies_against_static_buffer);
+	RUN_TEST(test_small_message_has_half_the_writes);
+	RUN_TEST(test_no_memory);
+	return UNITY_END();
+}
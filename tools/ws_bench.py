@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+"""WebSocket load generator and latency benchmark for the shade controller /ws endpoint.
+
+Opens N concurrent clients, replays a weighted mix of the commands sent by
+data/script.js and measures command-to-broadcast latency: the time between
+sending a command and the sending client receiving the matching broadcast.
+A separate monitor connection polls server heap with the getStats command.
+
+Broadcasts go to every client and carry no command id, so a command is timed
+only when its expected reply is unique among all clients: setShade values are
+picked so that no other client has the same value outstanding, and only one
+getTimers is timed at a time. stop is never timed because it broadcasts the
+current position, and nothing at all on an uncalibrated shade. Commands that
+cannot be timed are counted as untimed, not dropped.
+
+Note: setShade and slider bursts move a calibrated shade.
+
+Usage:
+    pip install websockets
+    python3 tools/ws_bench.py --url ws://192.168.1.50/ws --clients 8 --duration 60
+    python3 tools/ws_bench.py --mix setShade=4,stop=1,getTimers=2,slider=1 --json result.json
+"""
+
+import argparse
+import asyncio
+import json
+import random
+import statistics
+import time
+
+import websockets
+
+
+def parse_mix(text):
+    mix = {}
+    for item in text.split(","):
+        name, _, weight = item.partition("=")
+        if name not in ("setShade", "stop", "getTimers", "slider"):
+            raise argparse.ArgumentTypeError("unknown command in mix: " + name)
+        mix[name] = float(weight or 1)
+    return mix
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+class Owners:
+    """Expected replies reserved by clients: ("shade", value) or ("timers",).
+
+    A shade key stays reserved for a hold time after its reply arrived, the shade
+    is broadcast again when the motor reaches the target."""
+
+    def __init__(self, hold):
+        self.hold = hold
+        self.keys = {}  # key -> (client index, release time or None while pending)
+
+    def free(self, key, now):
+        owner = self.keys.get(key)
+        return owner is None or (owner[1] is not None and owner[1] < now)
+
+    def take(self, key, index, now):
+        if not self.free(key, now):
+            return False
+        self.keys[key] = (index, None)
+        return True
+
+    def release(self, key, now):
+        hold = self.hold if key[0] == "shade" else 0
+        self.keys[key] = (self.keys[key][0], now + hold)
+
+    def free_values(self, now):
+        return [v for v in range(101) if self.free(("shade", v), now)]
+
+
+class Client:
+    """One dashboard: sends commands and matches broadcasts to its own pending commands."""
+
+    def __init__(self, index, args, results, owners):
+        self.index = index
+        self.args = args
+        self.results = results
+        self.owners = owners
+        self.pending = []  # (kind, reserved reply key, send time)
+        self.received = 0
+        self.received_bytes = 0
+
+    @staticmethod
+    def matches(key, msg):
+        if key[0] == "timers":
+            return "timers" in msg
+        return msg.get("shade") is not None and int(msg["shade"]) == key[1]
+
+    def match(self, msg):
+        now = time.perf_counter()
+        for i, (kind, key, sent) in enumerate(self.pending):
+            if self.matches(key, msg):
+                self.results["latency"].setdefault(kind, []).append((now - sent) * 1000.0)
+                self.owners.release(key, now)
+                del self.pending[i]
+                return
+
+    def expire(self, force=False):
+        now = time.perf_counter()
+        alive = []
+        for item in self.pending:
+            if force or now - item[2] > self.args.timeout:
+                self.results["dropped"][item[0]] = self.results["dropped"].get(item[0], 0) + 1
+                self.owners.release(item[1], now)
+            else:
+                alive.append(item)
+        self.pending = alive
+
+    def untimed(self, kind):
+        self.results["untimed"][kind] = self.results["untimed"].get(kind, 0) + 1
+
+    async def receiver(self, ws):
+        async for frame in ws:
+            self.received += 1
+            self.received_bytes += len(frame)
+            try:
+                msg = json.loads(frame)
+            except ValueError:
+                self.results["bad_frames"] += 1
+                continue
+            if isinstance(msg, dict):
+                self.match(msg)
+
+    async def send_timed(self, ws, kind, cmd, key):
+        """Send command, timed only if its reply key can be reserved for this client."""
+        now = time.perf_counter()
+        if key is not None and self.owners.take(key, self.index, now):
+            self.pending.append((kind, key, now))
+        else:
+            self.untimed(kind)
+        await ws.send(json.dumps(cmd))
+
+    async def send(self, ws, kind):
+        if kind in ("slider", "setShade"):
+            # Values other clients wait for are not used, their broadcasts would match the wrong sender
+            free = self.owners.free_values(time.perf_counter()) or [random.randint(0, 100)]
+            if kind == "slider":
+                # Burst of slider positions like a finger dragging the slider, only the last one is timed
+                for _ in range(self.args.burst - 1):
+                    await ws.send(json.dumps({"cmd": "setShade", "shade": str(random.choice(free))}))
+                    await asyncio.sleep(self.args.burst_gap)
+                free = self.owners.free_values(time.perf_counter()) or free
+            value = random.choice(free)
+            await self.send_timed(ws, kind, {"cmd": "setShade", "shade": str(value)}, ("shade", value))
+        elif kind == "getTimers":
+            await self.send_timed(ws, kind, {"cmd": kind}, ("timers",))
+        else:
+            await self.send_timed(ws, kind, {"cmd": kind}, None)
+        self.results["sent"][kind] = self.results["sent"].get(kind, 0) + 1
+
+    async def run(self, deadline):
+        names = list(self.args.mix)
+        weights = [self.args.mix[n] for n in names]
+        try:
+            async with websockets.connect(self.args.url, max_size=None, open_timeout=self.args.timeout) as ws:
+                receiver = asyncio.ensure_future(self.receiver(ws))
+                while time.perf_counter() < deadline:
+                    await self.send(ws, random.choices(names, weights)[0])
+                    await asyncio.sleep(random.expovariate(self.args.rate))
+                    self.expire()
+                await asyncio.sleep(self.args.timeout)
+                self.expire()
+                receiver.cancel()
+        except (OSError, websockets.WebSocketException) as e:
+            self.results["errors"].append("client %d: %s" % (self.index, e))
+        self.expire(force=True)
+        self.results["frames"].append(self.received)
+        self.results["bytes"].append(self.received_bytes)
+
+
+async def monitor(args, results, deadline):
+    """Poll server heap and client count with getStats."""
+    try:
+        async with websockets.connect(args.url, max_size=None) as ws:
+            start = time.perf_counter()
+            while time.perf_counter() < deadline + args.timeout:
+                await ws.send(json.dumps({"cmd": "getStats"}))
+                reply_deadline = time.perf_counter() + args.timeout
+                while time.perf_counter() < reply_deadline:
+                    try:
+                        msg = json.loads(await asyncio.wait_for(ws.recv(), args.timeout))
+                    except asyncio.TimeoutError:
+                        break
+                    if isinstance(msg, dict) and "stats" in msg:
+                        stats = msg["stats"]
+                        stats["t"] = round(time.perf_counter() - start, 1)
+                        results["heap"].append(stats)
+                        break
+                await asyncio.sleep(args.stats_interval)
+    except (OSError, websockets.WebSocketException) as e:
+        results["errors"].append("monitor: %s" % e)
+
+
+async def main(args):
+    results = {"sent": {}, "untimed": {}, "latency": {}, "dropped": {}, "heap": [], "frames": [], "bytes": [], "errors": [], "bad_frames": 0}
+    deadline = time.perf_counter() + args.duration
+    owners = Owners(args.timeout)
+    clients = [Client(i, args, results, owners) for i in range(args.clients)]
+    tasks = [monitor(args, results, deadline)]
+    for client in clients:
+        tasks.append(client.run(deadline))
+        await asyncio.sleep(args.ramp / max(1, args.clients))
+    await asyncio.gather(*tasks)
+    return results
+
+
+def report(args, results):
+    print("url %s, %d clients, %d s, mix %s" % (args.url, args.clients, args.duration, args.mix))
+    print("%-10s %7s %7s %7s %9s %9s %9s %9s" % ("command", "sent", "untimed", "dropped", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+    for kind in sorted(results["sent"]):
+        lat = results["latency"].get(kind, [])
+        cells = ["%9.1f" % v if v is not None else "%9s" % "-" for v in (percentile(lat, 50), percentile(lat, 90), percentile(lat, 99), max(lat) if lat else None)]
+        print("%-10s %7d %7d %7d %s" % (kind, results["sent"][kind], results["untimed"].get(kind, 0), results["dropped"].get(kind, 0), " ".join(cells)))
+    if results["frames"]:
+        print("frames received per client: min %d, mean %.0f, max %d" % (min(results["frames"]), statistics.mean(results["frames"]), max(results["frames"])))
+        print("bytes received total: %d" % sum(results["bytes"]))
+    if results["heap"]:
+        heap = [s["heap"] for s in results["heap"]]
+        print("server heap: start %d, min %d, end %d, min ever %d" % (heap[0], min(heap), heap[-1], min(s["minHeap"] for s in results["heap"])))
+        for s in results["heap"]:
+            print("  t=%6.1f s heap %6d maxAlloc %6d clients %d" % (s["t"], s["heap"], s["maxAlloc"], s["clients"]))
+    for e in results["errors"]:
+        print("error:", e)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=1)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="ws://192.168.4.1/ws", help="WebSocket endpoint")
+    parser.add_argument("--clients", type=int, default=4, help="number of concurrent clients")
+    parser.add_argument("--duration", type=float, default=30, help="test duration, seconds")
+    parser.add_argument("--rate", type=float, default=1.0, help="mean commands per second per client")
+    parser.add_argument("--mix", type=parse_mix, default=parse_mix("setShade=4,stop=1,getTimers=2,slider=1"), help="weighted command mix")
+    parser.add_argument("--burst", type=int, default=10, help="setShade messages per slider burst")
+    parser.add_argument("--burst-gap", type=float, default=0.02, help="delay between slider burst messages, seconds")
+    parser.add_argument("--timeout", type=float, default=3.0, help="broadcast timeout before a command counts as dropped, seconds")
+    parser.add_argument("--ramp", type=float, default=2.0, help="time to open all clients, seconds")
+    parser.add_argument("--stats-interval", type=float, default=2.0, help="heap polling interval, seconds")
+    parser.add_argument("--json", help="write raw results to file")
+    args = parser.parse_args()
+    report(args, asyncio.run(main(args)))